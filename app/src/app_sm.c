@@ -0,0 +1,190 @@
+/*
+Application state machine, driven by button events and LED fade completions.
+Short presses toggle the matching LED, a double click on BTN0 chases a light
+across the LEDs, a long press on BTN0 breathes every LED and the next press
+flashes them full and fades them out before going back to manual control.
+Without the blink engine only the manual toggles are built.
+*/
+
+#include <zephyr/kernel.h>
+#include <zephyr/smf.h>
+
+#include "app_sm.h"
+#include "BTN.h"
+#include "LATENCY.h"
+#include "LED.h"
+#include "SM.h"
+
+#if defined(CONFIG_APP_BLE)
+#include "ble_service.h"
+#endif
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define APP_DUTY_CYCLE_FULL     100
+#define APP_BREATHE_PERIOD_MS   2000
+#define APP_FADE_OUT_MS         500
+#define APP_CHASE_STEP_MS       100
+#define APP_CHASE_PLAYS         3
+
+/* ----------------------------------------------------------------------------
+                                    Types
+---------------------------------------------------------------------------- */
+typedef enum app_state_t {
+  APP_STATE_MANUAL = 0,
+#if defined(CONFIG_LED_BLINK)
+  APP_STATE_BREATHE,
+  APP_STATE_FADE_OUT,
+#endif
+} app_state;
+
+typedef struct app_sm_object_t {
+  struct smf_ctx ctx; // Must be first, SMF_CTX casts the object
+  sm_event event; // Event the current state is run with
+#if defined(CONFIG_LED_BLINK)
+  uint32_t fading_mask; // LEDs still fading out
+#endif
+} app_sm_object;
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static enum smf_state_result _app_manual_run(void *o);
+
+#if defined(CONFIG_LED_BLINK)
+static void _app_breathe_entry(void *o);
+
+static enum smf_state_result _app_breathe_run(void *o);
+
+static void _app_fade_out_entry(void *o);
+
+static enum smf_state_result _app_fade_out_run(void *o);
+#endif
+
+static bool _app_is_btn_event(const sm_event *event, btn_event_type type);
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+static const struct smf_state _app_states[] = {
+  [APP_STATE_MANUAL] = SMF_CREATE_STATE(NULL, _app_manual_run, NULL, NULL, NULL),
+#if defined(CONFIG_LED_BLINK)
+  [APP_STATE_BREATHE] = SMF_CREATE_STATE(_app_breathe_entry, _app_breathe_run, NULL, NULL, NULL),
+  [APP_STATE_FADE_OUT] = SMF_CREATE_STATE(_app_fade_out_entry, _app_fade_out_run, NULL, NULL, NULL),
+#endif
+};
+
+static app_sm_object _app_sm;
+
+#if defined(CONFIG_LED_PATTERN)
+BUILD_ASSERT(NUM_LEDS >= 4, "The chase pattern walks four LEDs");
+
+// Each LED in turn then a dark step, one engine wakeup per frame
+LED_PATTERN_DEFINE(_app_chase, APP_CHASE_PLAYS,
+  LED_FRAME(APP_CHASE_STEP_MS, LED_ALL_MASK, [LED0] = APP_DUTY_CYCLE_FULL),
+  LED_FRAME(APP_CHASE_STEP_MS, LED_ALL_MASK, [LED1] = APP_DUTY_CYCLE_FULL),
+  LED_FRAME(APP_CHASE_STEP_MS, LED_ALL_MASK, [LED2] = APP_DUTY_CYCLE_FULL),
+  LED_FRAME(APP_CHASE_STEP_MS, LED_ALL_MASK, [LED3] = APP_DUTY_CYCLE_FULL),
+  LED_FRAME(APP_CHASE_STEP_MS, LED_ALL_MASK, 0),
+);
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Checks if an event is the given kind of button event
+ */
+static bool _app_is_btn_event(const sm_event *event, btn_event_type type) {
+  return SM_EVENT_BTN == event->type && type == event->arg;
+}
+
+static enum smf_state_result _app_manual_run(void *o) {
+  app_sm_object *sm = o;
+
+  if (_app_is_btn_event(&sm->event, BTN_EVENT_PRESS) && sm->event.source < NUM_LEDS) {
+    LED_toggle(sm->event.source);
+    LATENCY_PROBE(LATENCY_LED_WRITTEN, sm->event.source);
+#if defined(CONFIG_LED_BLINK)
+  } else if (_app_is_btn_event(&sm->event, BTN_EVENT_LONG_PRESS) && BTN0 == sm->event.source) {
+    smf_set_state(SMF_CTX(sm), &_app_states[APP_STATE_BREATHE]);
+#endif
+#if defined(CONFIG_LED_PATTERN)
+  } else if (_app_is_btn_event(&sm->event, BTN_EVENT_MULTI_CLICK) && BTN0 == sm->event.source) {
+    LED_pattern_play(&_app_chase);
+#endif
+  }
+  return SMF_EVENT_HANDLED;
+}
+
+#if defined(CONFIG_LED_BLINK)
+static void _app_breathe_entry(void *o) {
+  for (int i = 0; i < NUM_LEDS; i++) {
+    LED_breathe(i, 0, APP_DUTY_CYCLE_FULL, APP_BREATHE_PERIOD_MS);
+  }
+}
+
+static enum smf_state_result _app_breathe_run(void *o) {
+  app_sm_object *sm = o;
+
+  if (_app_is_btn_event(&sm->event, BTN_EVENT_PRESS)) {
+    smf_set_state(SMF_CTX(sm), &_app_states[APP_STATE_FADE_OUT]);
+  }
+  return SMF_EVENT_HANDLED;
+}
+
+static void _app_fade_out_entry(void *o) {
+  app_sm_object *sm = o;
+
+  sm->fading_mask = 0;
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (0 == LED_fade(i, APP_DUTY_CYCLE_FULL, 0, APP_FADE_OUT_MS, LED_FADE_GAMMA)) {
+      sm->fading_mask |= BIT(i);
+    }
+  }
+}
+
+static enum smf_state_result _app_fade_out_run(void *o) {
+  app_sm_object *sm = o;
+
+  if (SM_EVENT_LED_DONE == sm->event.type) {
+    sm->fading_mask &= ~BIT(sm->event.source);
+  }
+  if (0 == sm->fading_mask) {
+    smf_set_state(SMF_CTX(sm), &_app_states[APP_STATE_MANUAL]);
+  }
+  return SMF_EVENT_HANDLED;
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Inits the state machine and hooks it up to the drivers, call after BTN_init and LED_init
+ *
+ * @return Error code, < 0 on failures
+ */
+int app_sm_init() {
+  int rv = SM_init();
+  if (rv < 0) {
+    return rv;
+  }
+  smf_set_initial(SMF_CTX(&_app_sm), &_app_states[APP_STATE_MANUAL]);
+  return 0;
+}
+
+/**
+ * @brief Sleeps until the next event and runs the current state with it
+ *
+ * @return Non zero once the state machine has terminated
+ */
+int32_t app_sm_run() {
+  int32_t rv = SM_run(SMF_CTX(&_app_sm), &_app_sm.event);
+#if defined(CONFIG_APP_BLE)
+  // After the state ran so the LEDs react before the event goes out over the air
+  ble_service_btn_event(&_app_sm.event);
+#endif
+  return rv;
+}
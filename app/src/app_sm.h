@@ -0,0 +1,17 @@
+/*
+Header to define the application state machine interface
+*/
+
+#ifndef APP_SM_H
+#define APP_SM_H
+
+#include <stdint.h>
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+int app_sm_init();
+
+int32_t app_sm_run();
+
+#endif
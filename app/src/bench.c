@@ -0,0 +1,220 @@
+/*
+On target benchmarks of the LED and button driver hot paths. Every result is printed as a
+single BENCH,<name>,<value>,<unit> line so CI can compare runs, BENCH,done ends the run.
+*/
+
+#include <inttypes.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/timing/timing.h>
+
+#include "bench.h"
+#include "BTN.h"
+#include "LATENCY.h"
+#include "LED.h"
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define BENCH_CALLS               1000 // Calls averaged per API cost
+#define BENCH_WINDOW_MS           1000 // CPU load and wakeups are measured over one second
+#define BENCH_SETTLE_MS           100 // Lets a new blink configuration reach its steady state
+#define BENCH_NAME_SIZE           32
+
+#define BENCH_PPM                 1000000ULL
+
+/* ----------------------------------------------------------------------------
+                                    Types
+---------------------------------------------------------------------------- */
+typedef int (*bench_call)(int i);
+
+typedef struct bench_api_t {
+  const char *name;
+  bench_call call;
+} bench_api;
+
+typedef struct bench_load_t {
+  uint32_t busy_ppm; // Non idle share of the window in parts per million
+  uint32_t wakeups; // Execution windows of non idle threads, a proxy for idle exits
+} bench_load;
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static void _bench_print(const char *name, uint64_t value, const char *unit);
+
+static int _bench_led_pwm(int i);
+
+static int _bench_led_toggle(int i);
+
+static int _bench_led_set(int i);
+
+static int _bench_led_set_same(int i);
+
+static void _bench_api_costs(void);
+
+static bench_load _bench_measure_load(void);
+
+static void _bench_blink_load(void);
+
+static void _bench_debounce_latency(void);
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+static const bench_api _bench_apis[] = {
+  {.name="led_pwm", .call=_bench_led_pwm},
+  {.name="led_toggle", .call=_bench_led_toggle},
+  {.name="led_set", .call=_bench_led_set},
+  {.name="led_set_same", .call=_bench_led_set_same},
+};
+
+static const led_frequency _bench_frequencies[] = {LED_1HZ, LED_2HZ, LED_4HZ, LED_8HZ, LED_16HZ};
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Prints one machine readable result line
+ */
+static void _bench_print(const char *name, uint64_t value, const char *unit) {
+  printk("BENCH,%s,%" PRIu64 ",%s\n", name, value, unit);
+}
+
+static int _bench_led_pwm(int i) {
+  return LED_pwm(LED0, i % 101);
+}
+
+static int _bench_led_toggle(int i) {
+  return LED_toggle(LED0);
+}
+
+static int _bench_led_set(int i) {
+  return LED_set(LED0, (i & 1) ? LED_ON : LED_OFF);
+}
+
+// Every call after the first is a no-op the write cache skips
+static int _bench_led_set_same(int i) {
+  return LED_set(LED0, LED_ON);
+}
+
+/**
+ * @brief Times BENCH_CALLS calls of every API and prints the mean cost of one call
+ */
+static void _bench_api_costs(void) {
+  for (size_t i = 0; i < ARRAY_SIZE(_bench_apis); i++) {
+    timing_t start = timing_counter_get();
+    for (int call = 0; call < BENCH_CALLS; call++) {
+      _bench_apis[i].call(call);
+    }
+    timing_t end = timing_counter_get();
+
+    uint64_t cycles = timing_cycles_get(&start, &end);
+    char name[BENCH_NAME_SIZE];
+    snprintk(name, sizeof(name), "%s_cycles", _bench_apis[i].name);
+    _bench_print(name, cycles / BENCH_CALLS, "cycles");
+    snprintk(name, sizeof(name), "%s_ns", _bench_apis[i].name);
+    _bench_print(name, timing_cycles_to_ns(cycles) / BENCH_CALLS, "ns");
+  }
+  LED_set_mask(LED_ALL_MASK, 0);
+}
+
+/**
+ * @brief Sleeps through one window and reports how busy the CPU was in it.
+ *        The benchmark thread's own wakeup is part of the result
+ */
+static bench_load _bench_measure_load(void) {
+  k_thread_runtime_stats_t before;
+  k_thread_runtime_stats_t after;
+  bench_load load = {0};
+
+  k_thread_runtime_stats_all_get(&before);
+  k_msleep(BENCH_WINDOW_MS);
+  k_thread_runtime_stats_all_get(&after);
+
+  uint64_t window = after.execution_cycles - before.execution_cycles;
+  uint64_t busy = after.total_cycles - before.total_cycles;
+  if (window) {
+    load.busy_ppm = (busy * BENCH_PPM) / window;
+  }
+  // The average covers every window so far, dividing it out gives the window count
+  if (after.average_cycles && before.average_cycles) {
+    load.wakeups = (after.total_cycles / after.average_cycles) - (before.total_cycles / before.average_cycles);
+  } else if (after.average_cycles) {
+    load.wakeups = after.total_cycles / after.average_cycles;
+  }
+  return load;
+}
+
+/**
+ * @brief Blinks 1 to 4 LEDs at every frequency and prints the CPU load and wakeups per second,
+ *        with all LEDs static as the baseline
+ */
+static void _bench_blink_load(void) {
+  char name[BENCH_NAME_SIZE];
+
+  LED_set_mask(LED_ALL_MASK, 0);
+  k_msleep(BENCH_SETTLE_MS);
+  bench_load load = _bench_measure_load();
+  _bench_print("static_busy", load.busy_ppm, "ppm");
+  _bench_print("static_wakeups", load.wakeups, "per_s");
+
+  for (int leds = 1; leds <= MIN(NUM_LEDS, 4); leds++) {
+    for (size_t f = 0; f < ARRAY_SIZE(_bench_frequencies); f++) {
+      LED_set_mask(LED_ALL_MASK, 0);
+      for (int i = 0; i < leds; i++) {
+        LED_blink(i, _bench_frequencies[f]);
+      }
+      k_msleep(BENCH_SETTLE_MS);
+      load = _bench_measure_load();
+
+      snprintk(name, sizeof(name), "blink_%dhz_%dled_busy", _bench_frequencies[f], leds);
+      _bench_print(name, load.busy_ppm, "ppm");
+      snprintk(name, sizeof(name), "blink_%dhz_%dled_wakeups", _bench_frequencies[f], leds);
+      _bench_print(name, load.wakeups, "per_s");
+    }
+  }
+  LED_set_mask(LED_ALL_MASK, 0);
+}
+
+/**
+ * @brief Collects presses for CONFIG_APP_BENCH_PRESS_MS and prints their edge to debounce latency,
+ *        a run without presses reports a count of 0
+ */
+static void _bench_debounce_latency(void) {
+  latency_stats stats;
+
+  if (CONFIG_APP_BENCH_PRESS_MS > 0) {
+    printk("BENCH: press any button during the next %d ms\n", CONFIG_APP_BENCH_PRESS_MS);
+    LATENCY_reset();
+    LATENCY_enable(true);
+    k_msleep(CONFIG_APP_BENCH_PRESS_MS);
+  }
+
+  LATENCY_get_stats(LATENCY_BTN_DEBOUNCED, &stats);
+  _bench_print("debounce_count", stats.count, "samples");
+  _bench_print("debounce_min", stats.min, "cpu_cycles");
+  _bench_print("debounce_mean", stats.mean, "cpu_cycles");
+  _bench_print("debounce_p99", stats.p99, "cpu_cycles");
+  _bench_print("debounce_max", stats.max, "cpu_cycles");
+}
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Runs every benchmark once, call after BTN_init, LED_init and LATENCY_init
+ */
+void bench_run() {
+  timing_init();
+  timing_start();
+
+  _bench_print("timing_freq", timing_freq_get_mhz(), "MHz");
+  _bench_api_costs();
+  _bench_blink_load();
+  _bench_debounce_latency();
+
+  timing_stop();
+  printk("BENCH,done\n");
+}
@@ -0,0 +1,13 @@
+/*
+Header to define the on target driver benchmarks
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+void bench_run();
+
+#endif
@@ -0,0 +1,476 @@
+/*
+LED and button GATT service. LED writes come in without response and may carry several
+LEDs per write so one connection event can change every LED through LED_pwm_multi.
+Button events are batched and flushed once per connection interval, so a burst of
+presses costs a single notification. The connection and advertising parameters follow
+a low latency or a low power profile, picked in Kconfig or switched on button activity.
+*/
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "ble_service.h"
+#include "BTN.h"
+#include "LATENCY.h"
+#include "LED.h"
+
+BUILD_ASSERT(NUM_LEDS <= 16, "BLE_LED_OP_PWM carries a 16 bit LED mask");
+// The supervision timeout has to outlast two slept through stretches of the low power profile
+BUILD_ASSERT(4 * CONFIG_APP_BLE_SUPERVISION_TIMEOUT > (1 + CONFIG_APP_BLE_SLOW_LATENCY) * CONFIG_APP_BLE_SLOW_INTERVAL,
+  "APP_BLE_SUPERVISION_TIMEOUT is too short for the low power interval and latency");
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define BLE_BTN_BATCH_SIZE        16 // Button events held until the next flush
+#define BLE_ATT_HEADER_SIZE       3 // Opcode and handle in front of every notification
+
+#define BLE_LED_PWM_HEADER_SIZE   3 // Op and led_mask, the duty cycles follow
+#define BLE_LED_BLINK_SIZE        8
+#define BLE_LED_FADE_SIZE         7
+
+#define BLE_DEFAULT_INTERVAL      K_MSEC(30) // Until the connection reports its own
+
+#if defined(CONFIG_APP_BLE_PROFILE_LOW_POWER)
+#define BLE_PROFILE_INITIAL       BLE_PROFILE_LOW_POWER
+#else
+#define BLE_PROFILE_INITIAL       BLE_PROFILE_LOW_LATENCY // The auto profile starts as if a button was just used
+#endif
+
+/* ----------------------------------------------------------------------------
+                                  Macro Helpers
+---------------------------------------------------------------------------- */
+#define BLE_BTN_ATTR  (&_ble_gatt_service.attrs[4]) // Value attribute of the button characteristic
+
+/* ----------------------------------------------------------------------------
+                                    Types
+---------------------------------------------------------------------------- */
+typedef enum ble_profile_t {
+  BLE_PROFILE_LOW_LATENCY = 0,
+  BLE_PROFILE_LOW_POWER,
+  NUM_BLE_PROFILES,
+} ble_profile;
+
+typedef struct ble_state_t {
+  struct k_spinlock lock; // Guards everything below
+  struct bt_conn *conn; // Referenced while connected
+  k_timeout_t interval; // Connection interval, the button batch is flushed once per interval
+  bool notify; // Button notifications are subscribed
+  ble_btn_record records[BLE_BTN_BATCH_SIZE];
+  uint8_t count;
+  ble_profile profile; // Profile the link is or is about to be on
+  bool advertising;
+  struct k_work_delayable flush;
+  struct k_work advertise;
+  struct k_work apply; // Moves the link or the advertiser onto the current profile
+  struct k_work_delayable idle; // Drops to the low power profile once the buttons go quiet
+} ble_state;
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static ssize_t _ble_led_write(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags);
+
+static void _ble_btn_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+
+static void _ble_btn_flush(struct k_work *work);
+
+static void _ble_advertise(struct k_work *work);
+
+static int _ble_advertise_start(ble_profile profile);
+
+static void _ble_set_profile(ble_profile profile);
+
+static void _ble_apply_profile(struct k_work *work);
+
+#if defined(CONFIG_APP_BLE_PROFILE_AUTO)
+static void _ble_idle(struct k_work *work);
+#endif
+
+static void _ble_set_interval(uint16_t interval);
+
+static void _ble_connected(struct bt_conn *conn, uint8_t err);
+
+static void _ble_disconnected(struct bt_conn *conn, uint8_t reason);
+
+static void _ble_recycled(void);
+
+static void _ble_le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout);
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+static const struct bt_uuid_128 _ble_service_uuid = BT_UUID_INIT_128(BLE_SERVICE_UUID_VAL);
+static const struct bt_uuid_128 _ble_led_uuid = BT_UUID_INIT_128(BLE_LED_UUID_VAL);
+static const struct bt_uuid_128 _ble_btn_uuid = BT_UUID_INIT_128(BLE_BTN_UUID_VAL);
+
+static const struct bt_data _ble_advertising[] = {
+  BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
+  BT_DATA_BYTES(BT_DATA_UUID128_ALL, BLE_SERVICE_UUID_VAL),
+};
+
+static const struct bt_data _ble_scan_response[] = {
+  BT_DATA(BT_DATA_NAME_COMPLETE, CONFIG_BT_DEVICE_NAME, sizeof(CONFIG_BT_DEVICE_NAME) - 1),
+};
+
+// Low latency answers a press within a couple of short intervals. Low power keeps a short interval
+// so a press can still go out on the next event, but peripheral latency lets the radio sleep through
+// every event it has nothing to send in
+static const struct bt_le_conn_param _ble_conn_params[NUM_BLE_PROFILES] = {
+  [BLE_PROFILE_LOW_LATENCY] = BT_LE_CONN_PARAM_INIT(CONFIG_APP_BLE_FAST_INTERVAL, CONFIG_APP_BLE_FAST_INTERVAL, 0, CONFIG_APP_BLE_SUPERVISION_TIMEOUT),
+  [BLE_PROFILE_LOW_POWER] = BT_LE_CONN_PARAM_INIT(CONFIG_APP_BLE_SLOW_INTERVAL, CONFIG_APP_BLE_SLOW_INTERVAL, CONFIG_APP_BLE_SLOW_LATENCY, CONFIG_APP_BLE_SUPERVISION_TIMEOUT),
+};
+
+static const struct bt_le_adv_param _ble_adv_params[NUM_BLE_PROFILES] = {
+  [BLE_PROFILE_LOW_LATENCY] = BT_LE_ADV_PARAM_INIT(BT_LE_ADV_OPT_CONN, BT_GAP_ADV_FAST_INT_MIN_1, BT_GAP_ADV_FAST_INT_MAX_1, NULL),
+  [BLE_PROFILE_LOW_POWER] = BT_LE_ADV_PARAM_INIT(BT_LE_ADV_OPT_CONN, BT_GAP_ADV_SLOW_INT_MIN, BT_GAP_ADV_SLOW_INT_MAX, NULL),
+};
+
+BT_GATT_SERVICE_DEFINE(_ble_gatt_service,
+  BT_GATT_PRIMARY_SERVICE(&_ble_service_uuid),
+  BT_GATT_CHARACTERISTIC(&_ble_led_uuid.uuid, BT_GATT_CHRC_WRITE_WITHOUT_RESP, BT_GATT_PERM_WRITE, NULL, _ble_led_write, NULL),
+  BT_GATT_CHARACTERISTIC(&_ble_btn_uuid.uuid, BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_NONE, NULL, NULL, NULL),
+  BT_GATT_CCC(_ble_btn_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+);
+
+BT_CONN_CB_DEFINE(_ble_conn_callbacks) = {
+  .connected = _ble_connected,
+  .disconnected = _ble_disconnected,
+  .recycled = _ble_recycled,
+  .le_param_updated = _ble_le_param_updated,
+};
+
+static ble_state _ble = {
+  .conn = NULL,
+  .notify = false,
+  .count = 0,
+  .profile = BLE_PROFILE_INITIAL,
+  .advertising = false,
+};
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Applies every LED record of a write, in order
+ *
+ * @return len once every record is applied, an ATT error if a record is malformed or rejected
+ */
+static ssize_t _ble_led_write(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags) {
+  const uint8_t *data = buf;
+  uint16_t pos = 0;
+
+  if (0 != offset) {
+    return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+  }
+
+  while (pos < len) {
+    const uint8_t *record = &data[pos];
+    uint16_t left = len - pos;
+    int rv = 0;
+
+    switch (record[0]) {
+      case BLE_LED_OP_PWM: {
+        uint8_t duty_cycles[NUM_LEDS] = {0};
+        if (left < BLE_LED_PWM_HEADER_SIZE) {
+          return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+        }
+        uint16_t led_mask = sys_get_le16(&record[1]);
+        if (led_mask & ~LED_ALL_MASK) {
+          return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+        }
+        uint16_t size = BLE_LED_PWM_HEADER_SIZE + __builtin_popcount(led_mask);
+        if (left < size) {
+          return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+        }
+        // Duty cycles are packed, one per LED in the mask
+        const uint8_t *duty = &record[BLE_LED_PWM_HEADER_SIZE];
+        for (int i = 0; i < NUM_LEDS; i++) {
+          if (led_mask & BIT(i)) {
+            duty_cycles[i] = *duty++;
+          }
+        }
+        rv = LED_pwm_multi(led_mask, duty_cycles);
+        pos += size;
+        break;
+      }
+#if defined(CONFIG_LED_BLINK)
+      case BLE_LED_OP_BLINK:
+        if (left < BLE_LED_BLINK_SIZE) {
+          return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+        }
+        rv = LED_blink_ms(record[1], sys_get_le16(&record[2]), sys_get_le16(&record[4]), sys_get_le16(&record[6]));
+        pos += BLE_LED_BLINK_SIZE;
+        break;
+      case BLE_LED_OP_FADE:
+        if (left < BLE_LED_FADE_SIZE) {
+          return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+        }
+        rv = LED_fade(record[1], record[2], record[3], sys_get_le16(&record[4]), record[6]);
+        pos += BLE_LED_FADE_SIZE;
+        break;
+#endif
+      default:
+        // Blink and fade records too when the blink engine is compiled out
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    if (rv < 0) {
+      // Records before this one stay applied
+      return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+  }
+  // The central can't say which press it answers, count it against the latest one
+  LATENCY_PROBE(LATENCY_LED_WRITTEN, LATENCY_KEY_LAST);
+  return len;
+}
+
+/**
+ * @brief Tracks the button notification subscription, drops anything batched once it ends
+ */
+static void _ble_btn_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value) {
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  _ble.notify = (BT_GATT_CCC_NOTIFY == value);
+  if (!_ble.notify) {
+    _ble.count = 0;
+  }
+  k_spin_unlock(&_ble.lock, key);
+}
+
+/**
+ * @brief Sends every batched button event that fits in one notification, runs once per connection interval
+ *
+ * @param [in] work The k_work struct contained by the flush k_work_delayable
+ */
+static void _ble_btn_flush(struct k_work *work) {
+  uint8_t payload[sizeof(_ble.records)];
+
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  struct bt_conn *conn = _ble.conn ? bt_conn_ref(_ble.conn) : NULL;
+  k_timeout_t interval = _ble.interval;
+  k_spin_unlock(&_ble.lock, key);
+
+  if (NULL == conn) {
+    return;
+  }
+
+  uint16_t fit = (bt_gatt_get_mtu(conn) - BLE_ATT_HEADER_SIZE) / sizeof(ble_btn_record);
+
+  key = k_spin_lock(&_ble.lock);
+  uint8_t count = MIN(_ble.count, fit);
+  memcpy(payload, _ble.records, count * sizeof(ble_btn_record));
+  // Whatever didn't fit goes out on the next interval
+  _ble.count -= count;
+  memmove(_ble.records, &_ble.records[count], _ble.count * sizeof(ble_btn_record));
+  bool more = _ble.count > 0;
+  k_spin_unlock(&_ble.lock, key);
+
+  if (count) {
+    bt_gatt_notify(conn, BLE_BTN_ATTR, payload, count * sizeof(ble_btn_record));
+  }
+  bt_conn_unref(conn);
+
+  if (more) {
+    k_work_schedule(k_work_delayable_from_work(work), interval);
+  }
+}
+
+/**
+ * @brief Starts connectable advertising of the service
+ *
+ * @param [in] work The advertise k_work struct, unused
+ */
+static void _ble_advertise(struct k_work *work) {
+  _ble_advertise_start(_ble.profile);
+}
+
+/**
+ * @brief Starts connectable advertising with the parameters of the given profile
+ *
+ * @param [in] profile The profile to advertise with
+ *
+ * @return Error code, < 0 on failures
+ */
+static int _ble_advertise_start(ble_profile profile) {
+  int rv = bt_le_adv_start(&_ble_adv_params[profile], _ble_advertising, ARRAY_SIZE(_ble_advertising), _ble_scan_response, ARRAY_SIZE(_ble_scan_response));
+
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  _ble.advertising = (0 == rv);
+  k_spin_unlock(&_ble.lock, key);
+  return rv;
+}
+
+/**
+ * @brief Switches to the given profile, the Bluetooth calls run from the system workqueue
+ *
+ * @param [in] profile The profile to switch to
+ */
+static void _ble_set_profile(ble_profile profile) {
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  bool changed = profile != _ble.profile;
+  _ble.profile = profile;
+  k_spin_unlock(&_ble.lock, key);
+
+  if (changed) {
+    k_work_submit(&_ble.apply);
+  }
+}
+
+/**
+ * @brief Requests the current profile's parameters on the connection, or restarts advertising with them
+ *
+ * @param [in] work The apply k_work struct, unused
+ */
+static void _ble_apply_profile(struct k_work *work) {
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  struct bt_conn *conn = _ble.conn ? bt_conn_ref(_ble.conn) : NULL;
+  ble_profile profile = _ble.profile;
+  bool advertising = _ble.advertising;
+  k_spin_unlock(&_ble.lock, key);
+
+  if (conn) {
+    // The central has the final say, le_param_updated reports what it picked
+    bt_conn_le_param_update(conn, &_ble_conn_params[profile]);
+    bt_conn_unref(conn);
+  } else if (advertising) {
+    bt_le_adv_stop();
+    _ble_advertise_start(profile);
+  }
+}
+
+#if defined(CONFIG_APP_BLE_PROFILE_AUTO)
+/**
+ * @brief Called once no button was used for CONFIG_APP_BLE_IDLE_MS
+ *
+ * @param [in] work The k_work struct contained by the idle k_work_delayable, unused
+ */
+static void _ble_idle(struct k_work *work) {
+  _ble_set_profile(BLE_PROFILE_LOW_POWER);
+}
+#endif
+
+/**
+ * @brief Stores the connection interval the button batch is flushed at
+ *
+ * @param [in] interval The connection interval in 1.25 ms units
+ */
+static void _ble_set_interval(uint16_t interval) {
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  _ble.interval = K_USEC(BT_CONN_INTERVAL_TO_US(interval));
+  k_spin_unlock(&_ble.lock, key);
+}
+
+static void _ble_connected(struct bt_conn *conn, uint8_t err) {
+  struct bt_conn_info info;
+
+  if (err) {
+    return;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  if (NULL == _ble.conn) {
+    _ble.conn = bt_conn_ref(conn);
+    _ble.count = 0;
+  }
+  // Connectable advertising ends with the connection
+  _ble.advertising = false;
+  k_spin_unlock(&_ble.lock, key);
+
+  if (0 == bt_conn_get_info(conn, &info)) {
+    _ble_set_interval(info.le.interval);
+  }
+  // The central opens the link with its own parameters
+  k_work_submit(&_ble.apply);
+}
+
+static void _ble_disconnected(struct bt_conn *conn, uint8_t reason) {
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  struct bt_conn *ours = (conn == _ble.conn) ? _ble.conn : NULL;
+  if (ours) {
+    _ble.conn = NULL;
+    _ble.notify = false;
+    _ble.count = 0;
+    _ble.interval = BLE_DEFAULT_INTERVAL;
+  }
+  k_spin_unlock(&_ble.lock, key);
+
+  if (ours) {
+    bt_conn_unref(ours);
+  }
+}
+
+/**
+ * @brief Called once a connection object is free again, advertising can restart
+ */
+static void _ble_recycled(void) {
+  k_work_submit(&_ble.advertise);
+}
+
+static void _ble_le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout) {
+  if (conn == _ble.conn) {
+    _ble_set_interval(interval);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Enables Bluetooth and starts advertising the LED and button service
+ *
+ * @return Error code, < 0 on failures
+ */
+int ble_service_init() {
+  _ble.interval = BLE_DEFAULT_INTERVAL;
+  k_work_init_delayable(&_ble.flush, _ble_btn_flush);
+  k_work_init(&_ble.advertise, _ble_advertise);
+  k_work_init(&_ble.apply, _ble_apply_profile);
+#if defined(CONFIG_APP_BLE_PROFILE_AUTO)
+  k_work_init_delayable(&_ble.idle, _ble_idle);
+  k_work_schedule(&_ble.idle, K_MSEC(CONFIG_APP_BLE_IDLE_MS));
+#endif
+
+  int rv = bt_enable(NULL);
+  if (rv < 0) {
+    return rv;
+  }
+  return _ble_advertise_start(_ble.profile);
+}
+
+/**
+ * @brief Batches a button event for the next notification, other events are ignored.
+ *        Only the first event of a batch arms the flush, later ones ride along with it.
+ *        With the auto profile any button event also moves the link to low latency
+ *
+ * @param [in] event The state machine event
+ */
+void ble_service_btn_event(const sm_event *event) {
+  if (SM_EVENT_BTN != event->type) {
+    return;
+  }
+
+#if defined(CONFIG_APP_BLE_PROFILE_AUTO)
+  _ble_set_profile(BLE_PROFILE_LOW_LATENCY);
+  k_work_reschedule(&_ble.idle, K_MSEC(CONFIG_APP_BLE_IDLE_MS));
+#endif
+
+  k_spinlock_key_t key = k_spin_lock(&_ble.lock);
+  bool arm = false;
+  if (_ble.notify && _ble.count < BLE_BTN_BATCH_SIZE) {
+    _ble.records[_ble.count++] = (ble_btn_record){.btn=event->source, .type=event->arg, .clicks=event->clicks};
+    arm = (1 == _ble.count);
+  }
+  k_timeout_t interval = _ble.interval;
+  k_spin_unlock(&_ble.lock, key);
+
+  if (arm) {
+    // Schedule rather than reschedule so a steady stream of presses can't hold the flush back
+    k_work_schedule(&_ble.flush, interval);
+  }
+}
@@ -0,0 +1,50 @@
+/*
+Header to define the LED and button GATT service interface
+
+LED characteristic, write without response. A write holds one or more records back to back:
+  BLE_LED_OP_PWM:   op, led_mask (le16), one duty cycle per set bit of led_mask in led_id order
+  BLE_LED_OP_BLINK: op, led, on_ms (le16), off_ms (le16), phase_ms (le16)
+  BLE_LED_OP_FADE:  op, led, from, to, duration_ms (le16), curve
+
+Button characteristic, notify. Each notification holds every button event since the last
+one as ble_btn_record entries, at most one notification per connection interval.
+*/
+
+#ifndef BLE_SERVICE_H
+#define BLE_SERVICE_H
+
+#include <stdint.h>
+#include <zephyr/bluetooth/uuid.h>
+
+#include "SM.h"
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define BLE_SERVICE_UUID_VAL      BT_UUID_128_ENCODE(0x5a1e0000, 0x8f0c, 0x4c57, 0x9a3e, 0x6c1d2b3a4f50)
+#define BLE_LED_UUID_VAL          BT_UUID_128_ENCODE(0x5a1e0001, 0x8f0c, 0x4c57, 0x9a3e, 0x6c1d2b3a4f50)
+#define BLE_BTN_UUID_VAL          BT_UUID_128_ENCODE(0x5a1e0002, 0x8f0c, 0x4c57, 0x9a3e, 0x6c1d2b3a4f50)
+
+/* ----------------------------------------------------------------------------
+                                    TYPES
+---------------------------------------------------------------------------- */
+typedef enum ble_led_op_t {
+  BLE_LED_OP_PWM = 0x01, // LED_pwm_multi
+  BLE_LED_OP_BLINK, // LED_blink_ms
+  BLE_LED_OP_FADE, // LED_fade
+} ble_led_op;
+
+typedef struct __attribute__((packed)) ble_btn_record_t {
+  uint8_t btn; // btn_id
+  uint8_t type; // btn_event_type
+  uint8_t clicks;
+} ble_btn_record;
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+int ble_service_init();
+
+void ble_service_btn_event(const sm_event *event);
+
+#endif
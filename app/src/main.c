@@ -7,22 +7,68 @@
 #include <zephyr/kernel.h>
 #include <zephyr/sys/printk.h>
 
+#include "app_sm.h"
 #include "BTN.h"
 #include "LED.h"
+#include "LATENCY.h"
 
-#define SLEEP_MS 1
+#if defined(CONFIG_DIAG)
+#include "DIAG.h"
+#endif
+
+#if defined(CONFIG_APP_BLE)
+#include "ble_service.h"
+#endif
+
+#if defined(CONFIG_APP_BENCH)
+#include "bench.h"
+#endif
+
+#if defined(CONFIG_APP_SIM)
+#include "sim.h"
+#endif
 
 int main(void) {
 
+#if defined(CONFIG_LATENCY)
+  // First so the earliest presses are timed
+  LATENCY_init();
+#endif
+
+#if defined(CONFIG_DIAG)
+  DIAG_init();
+#endif
+
+  // First so the LEDs are written off before any settings are read from flash
+  if (0 > LED_init()) {
+    return 0;
+  }
   if (0 > BTN_init()) {
     return 0;
   }
-  if (0 > LED_init()) {
+
+#if defined(CONFIG_APP_BENCH)
+  // Before the state machine so nothing else drives the LEDs while they are timed
+  bench_run();
+#endif
+
+#if defined(CONFIG_APP_SIM)
+  // Injected presses are checked against the button events, nothing else may read them
+  sim_run();
+#endif
+
+  if (0 > app_sm_init()) {
+    return 0;
+  }
+
+#if defined(CONFIG_APP_BLE)
+  if (0 > ble_service_init()) {
     return 0;
   }
+#endif
 
-  while(1) {
-    k_msleep(SLEEP_MS);
+  // Sleeps between events, each one runs the current state once
+  while(0 == app_sm_run()) {
   }
 	return 0;
 }
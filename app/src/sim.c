@@ -0,0 +1,832 @@
+/*
+Host simulation of the button and LED drivers on native_sim. Presses with random contact
+bounce are injected through the emulated GPIO pins and checked against the events they
+must produce, blink schedules are timed from the emulated PWM writes. Every result is
+printed as a SIM,<name>,<value>,<unit> line, SIM,done,pass or SIM,done,fail ends the run.
+*/
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/drivers/pwm.h>
+#include <zephyr/sys/printk.h>
+
+#include "sim.h"
+#include "BTN.h"
+#include "LED.h"
+#include "PWM_EMUL.h"
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define SIM_SEED                  0x2545f491 // Fixed so every run injects the same presses
+
+#define SIM_MAX_BOUNCES           8 // Contact chatter edges before a level settles
+#define SIM_BOUNCE_MIN_US         20
+#define SIM_BOUNCE_MAX_US         1000 // Chatter gaps stay well inside every debounce time
+
+#define SIM_SETTLE_MS             (CONFIG_BTN_DEBOUNCE_MS + 10) // Covers the debounce of every backend
+#define SIM_GESTURE_QUIET_MS      (CONFIG_BTN_MULTI_CLICK_MS + 2 * SIM_SETTLE_MS) // Ends a click sequence
+#define SIM_MAX_EVENTS            8 // Longest event sequence one gesture produces, with room to spare
+
+#define SIM_HALF_PERIOD_US        (500 * USEC_PER_MSEC) // Half of a 1Hz blink period
+
+#define SIM_CALLS                 1000 // Calls averaged per write count
+#define SIM_NAME_SIZE             32
+
+#define SIM_TICK_US               (USEC_PER_SEC / CONFIG_SYS_CLOCK_TICKS_PER_SEC)
+#define SIM_BLINK_TOLERANCE_US    (CONFIG_LED_DEADLINE_SLACK_US + 2 * SIM_TICK_US) // Coalescing moves toggles early
+
+#define SIM_LAYER_BASE_DUTY       30 // Duty cycle LED0 has before the layers take it
+#define SIM_LAYER_BLINK_MS        100 // On and off time of the blink requested on the lowest layer
+
+#define SIM_FULL_DUTY             100 // The on part of a blink, shown as the brightness limit
+#define SIM_LIMIT_DUTY            50 // Brightness limit LED0 is checked at
+
+#if defined(CONFIG_LED_ASYNC)
+#define SIM_ASYNC_MAIN_COMMANDS   (CONFIG_LED_ASYNC_QUEUE_SIZE / 2) // Queued by the sim thread, the timer queues the rest
+BUILD_ASSERT(CONFIG_LED_ASYNC_QUEUE_SIZE < 100, "every command of the async burst raises LED0 by 1%");
+#endif
+
+/* ----------------------------------------------------------------------------
+                                  Macro Helpers
+---------------------------------------------------------------------------- */
+#define SIM_BTN_SPEC(node_id)  GPIO_DT_SPEC_GET(node_id, gpios),
+#define SIM_LED_SPEC(node_id)  PWM_DT_SPEC_GET(node_id),
+
+/* ----------------------------------------------------------------------------
+                                    Types
+---------------------------------------------------------------------------- */
+typedef enum sim_gesture_t {
+  SIM_CLICK = 0,
+  SIM_DOUBLE_CLICK,
+  SIM_LONG_PRESS,
+  NUM_SIM_GESTURES,
+} sim_gesture;
+
+typedef struct sim_stats_t {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+} sim_stats;
+
+typedef struct sim_led_t {
+  uint32_t changes; // Emulated channel changes seen so far
+  int64_t changed_ticks; // Tick of the last change, 0 before the first one
+} sim_led;
+
+typedef struct sim_state_t {
+  uint32_t rand;
+  uint32_t failures;
+
+  uint32_t settled_cycles; // k_cycle_get_32() when the injected level stopped bouncing
+  sim_stats debounce_us; // From the settled level to the press or release event
+
+  uint32_t blink_half_period_us; // Expected time between toggles, 0 while blinks aren't timed
+  sim_led leds[NUM_LEDS];
+  sim_stats blink_err_us; // Distance of every toggle from its half period
+
+  bool async_tracked; // LED0 changes are checked against the async burst
+  uint32_t async_changes; // LED0 changes seen while the burst drained
+  uint32_t async_on_cycles; // On time of the last of them, each command of the burst raises it
+  uint32_t async_reordered; // Changes that did not raise the on time
+  uint32_t async_rejected; // Commands of the burst the ring refused
+  struct k_timer async_timer;
+
+  bool limit_tracked; // The longest LED0 on time is kept while a limited blink runs
+  uint32_t limit_peak_on_cycles;
+} sim_state;
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static void _sim_print(const char *name, uint64_t value, const char *unit);
+
+static void _sim_fail(const char *what);
+
+static uint32_t _sim_rand(uint32_t range);
+
+static void _sim_stats_add(sim_stats *stats, uint32_t value);
+
+static void _sim_set_pin(btn_id btn, bool pressed);
+
+static void _sim_bounce(btn_id btn, bool pressed);
+
+static void _sim_hold(btn_id btn, uint32_t hold_ms);
+
+static int _sim_expect(sim_gesture gesture, btn_id btn, btn_event *expected);
+
+static void _sim_on_btn_event(const btn_event *event);
+
+static void _sim_presses(void);
+
+static void _sim_on_pwm_write(const struct device *dev, uint32_t channel, const pwm_emul_channel *state);
+
+static void _sim_blink_schedule(led_frequency frequency);
+
+static pwm_emul_channel _sim_channel(led_id led);
+
+static uint32_t _sim_on_cycles(led_id led);
+
+static uint32_t _sim_total_writes(void);
+
+static void _sim_write_counts(void);
+
+static void _sim_pm(void);
+
+#if defined(CONFIG_LED_ASYNC)
+static void _sim_async_expiry(struct k_timer *timer);
+#endif
+
+static void _sim_async(void);
+
+static void _sim_layers(void);
+
+static void _sim_max_duty_cycle(void);
+
+static void _sim_drop_events(void);
+
+static void _sim_led_binding(void);
+
+static void _sim_wait(void);
+
+static void _sim_debounce_ms(void);
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+static const struct gpio_dt_spec _sim_btn_specs[NUM_BTNS] = {
+  DT_FOREACH_CHILD_STATUS_OKAY(BTN_DT_NODE, SIM_BTN_SPEC)
+};
+
+static const struct pwm_dt_spec _sim_led_specs[NUM_LEDS] = {
+  DT_FOREACH_CHILD_STATUS_OKAY(LED_DT_NODE, SIM_LED_SPEC)
+};
+
+static const char *const _sim_gesture_names[NUM_SIM_GESTURES] = {
+  [SIM_CLICK] = "click",
+  [SIM_DOUBLE_CLICK] = "double_click",
+  [SIM_LONG_PRESS] = "long_press",
+};
+
+static sim_state _sim = {.rand=SIM_SEED};
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Prints one machine readable result line
+ */
+static void _sim_print(const char *name, uint64_t value, const char *unit) {
+  printk("SIM,%s,%" PRIu64 ",%s\n", name, value, unit);
+}
+
+/**
+ * @brief Counts a failed check, only the first few are described so a broken run stays readable
+ */
+static void _sim_fail(const char *what) {
+  if (_sim.failures++ < 10) {
+    printk("SIM: %s\n", what);
+  }
+}
+
+/**
+ * @brief xorshift32, repeatable across runs unlike the entropy driver
+ *
+ * @param [in] range Number of values to pick from
+ *
+ * @return A value from 0 to range - 1
+ */
+static uint32_t _sim_rand(uint32_t range) {
+  _sim.rand ^= _sim.rand << 13;
+  _sim.rand ^= _sim.rand >> 17;
+  _sim.rand ^= _sim.rand << 5;
+  return _sim.rand % range;
+}
+
+static void _sim_stats_add(sim_stats *stats, uint32_t value) {
+  stats->min = (0 == stats->count) ? value : MIN(stats->min, value);
+  stats->max = MAX(stats->max, value);
+  stats->sum += value;
+  stats->count++;
+}
+
+/**
+ * @brief Drives the emulated pin of a button, the edge interrupt runs before this returns
+ */
+static void _sim_set_pin(btn_id btn, bool pressed) {
+  const struct gpio_dt_spec *spec = &_sim_btn_specs[btn];
+  bool active_low = spec->dt_flags & GPIO_ACTIVE_LOW;
+
+  gpio_emul_input_set(spec->port, spec->pin, pressed != active_low);
+}
+
+/**
+ * @brief Moves a button to a new level through a burst of contact chatter
+ *
+ * @param [in] btn The button to move
+ * @param [in] pressed The level it settles at
+ */
+static void _sim_bounce(btn_id btn, bool pressed) {
+  uint32_t bounces = _sim_rand(SIM_MAX_BOUNCES + 1) & ~1U; // Even so the burst ends at the new level
+
+  for (uint32_t i = 0; i < bounces; i++) {
+    _sim_set_pin(btn, (i & 1) ? !pressed : pressed);
+    k_busy_wait(SIM_BOUNCE_MIN_US + _sim_rand(SIM_BOUNCE_MAX_US - SIM_BOUNCE_MIN_US));
+  }
+  _sim.settled_cycles = k_cycle_get_32();
+  _sim_set_pin(btn, pressed);
+}
+
+/**
+ * @brief Presses a button, holds it and releases it, both with chatter
+ */
+static void _sim_hold(btn_id btn, uint32_t hold_ms) {
+  _sim_bounce(btn, true);
+  k_msleep(hold_ms);
+  _sim_bounce(btn, false);
+}
+
+/**
+ * @brief Fills in the events a gesture must produce
+ *
+ * @param [in] gesture The gesture that was injected
+ * @param [in] btn The button it was injected on
+ * @param [out] expected Room for SIM_MAX_EVENTS events
+ *
+ * @return Number of events expected
+ */
+static int _sim_expect(sim_gesture gesture, btn_id btn, btn_event *expected) {
+  int count = 0;
+
+  switch (gesture) {
+    case SIM_CLICK:
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_PRESS, .clicks=1};
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_RELEASE, .clicks=1};
+      break;
+    case SIM_DOUBLE_CLICK:
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_PRESS, .clicks=1};
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_RELEASE, .clicks=1};
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_PRESS, .clicks=2};
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_RELEASE, .clicks=2};
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_MULTI_CLICK, .clicks=2};
+      break;
+    case SIM_LONG_PRESS:
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_PRESS, .clicks=1};
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_LONG_PRESS, .clicks=1};
+      expected[count++] = (btn_event){.btn=btn, .type=BTN_EVENT_RELEASE, .clicks=1};
+      break;
+    default:
+      break;
+  }
+  return count;
+}
+
+/**
+ * @brief Times every press and release from the moment its injected level stopped bouncing
+ */
+static void _sim_on_btn_event(const btn_event *event) {
+  if (BTN_EVENT_PRESS == event->type || BTN_EVENT_RELEASE == event->type) {
+    _sim_stats_add(&_sim.debounce_us, k_cyc_to_us_floor32(k_cycle_get_32() - _sim.settled_cycles));
+  }
+}
+
+/**
+ * @brief Injects CONFIG_APP_SIM_PRESSES random gestures on random buttons and checks each one
+ *        produces exactly its events
+ */
+static void _sim_presses(void) {
+  uint32_t gestures[NUM_SIM_GESTURES] = {0};
+  int64_t start_ms = k_uptime_get();
+  char what[64];
+
+  BTN_set_event_callback(_sim_on_btn_event);
+
+  for (int press = 0; press < CONFIG_APP_SIM_PRESSES; press++) {
+    sim_gesture gesture = _sim_rand(NUM_SIM_GESTURES);
+    btn_id btn = _sim_rand(NUM_BTNS);
+    btn_event expected[SIM_MAX_EVENTS];
+    btn_event event;
+
+    // Holds and gaps keep well clear of the long press and multi-click thresholds
+    switch (gesture) {
+      case SIM_CLICK:
+        _sim_hold(btn, SIM_SETTLE_MS + _sim_rand(CONFIG_BTN_LONG_PRESS_MS / 2));
+        break;
+      case SIM_DOUBLE_CLICK:
+        _sim_hold(btn, SIM_SETTLE_MS + _sim_rand(CONFIG_BTN_LONG_PRESS_MS / 2));
+        k_msleep(SIM_SETTLE_MS + _sim_rand(CONFIG_BTN_MULTI_CLICK_MS / 2));
+        _sim_hold(btn, SIM_SETTLE_MS + _sim_rand(CONFIG_BTN_LONG_PRESS_MS / 2));
+        break;
+      case SIM_LONG_PRESS:
+        _sim_hold(btn, CONFIG_BTN_LONG_PRESS_MS + 2 * SIM_SETTLE_MS + _sim_rand(CONFIG_BTN_LONG_PRESS_MS));
+        break;
+      default:
+        break;
+    }
+    k_msleep(SIM_GESTURE_QUIET_MS);
+    gestures[gesture]++;
+
+    int count = _sim_expect(gesture, btn, expected);
+    int seen = 0;
+    while (0 == BTN_get_event(&event, K_NO_WAIT)) {
+      if (seen < count && (event.btn != expected[seen].btn || event.type != expected[seen].type ||
+          event.clicks != expected[seen].clicks)) {
+        snprintk(what, sizeof(what), "%s %d on BTN%d: event %d was type %d clicks %d",
+          _sim_gesture_names[gesture], press, btn, seen, event.type, event.clicks);
+        _sim_fail(what);
+      }
+      seen++;
+    }
+    if (seen != count) {
+      snprintk(what, sizeof(what), "%s %d on BTN%d: %d events, expected %d",
+        _sim_gesture_names[gesture], press, btn, seen, count);
+      _sim_fail(what);
+    }
+  }
+
+  BTN_set_event_callback(NULL);
+
+  for (int i = 0; i < NUM_SIM_GESTURES; i++) {
+    _sim_print(_sim_gesture_names[i], gestures[i], "gestures");
+  }
+  _sim_print("press_sim_time", k_uptime_get() - start_ms, "ms");
+  _sim_print("debounce_count", _sim.debounce_us.count, "samples");
+  _sim_print("debounce_min", _sim.debounce_us.min, "us");
+  _sim_print("debounce_mean", _sim.debounce_us.count ? _sim.debounce_us.sum / _sim.debounce_us.count : 0, "us");
+  _sim_print("debounce_max", _sim.debounce_us.max, "us");
+}
+
+/**
+ * @brief Times every LED change against the half period of the running blink.
+ *        Runs in the context of the LED driver's pwm_set call
+ */
+static void _sim_on_pwm_write(const struct device *dev, uint32_t channel, const pwm_emul_channel *state) {
+  for (int i = 0; i < NUM_LEDS; i++) {
+    sim_led *led = &_sim.leds[i];
+
+    if (dev != _sim_led_specs[i].dev || channel != _sim_led_specs[i].channel || state->changes == led->changes) {
+      continue;
+    }
+    led->changes = state->changes;
+    if (LED0 == i && _sim.async_tracked) {
+      // The LED driver writes the active low pulse, the LED is on for the rest of the period
+      uint32_t on_cycles = state->period_cycles - state->pulse_cycles;
+      _sim.async_reordered += (on_cycles <= _sim.async_on_cycles);
+      _sim.async_on_cycles = on_cycles;
+      _sim.async_changes++;
+    }
+    if (LED0 == i && _sim.limit_tracked) {
+      _sim.limit_peak_on_cycles = MAX(_sim.limit_peak_on_cycles, state->period_cycles - state->pulse_cycles);
+    }
+    // The first toggle comes a half period after LED_blink, not after the last change
+    if (0 != _sim.blink_half_period_us && 0 != led->changed_ticks) {
+      uint32_t interval_us = k_ticks_to_us_near32(state->changed_ticks - led->changed_ticks);
+      uint32_t err_us = (interval_us > _sim.blink_half_period_us) ?
+        (interval_us - _sim.blink_half_period_us) : (_sim.blink_half_period_us - interval_us);
+      _sim_stats_add(&_sim.blink_err_us, err_us);
+    }
+    led->changed_ticks = state->changed_ticks;
+  }
+}
+
+/**
+ * @brief Blinks every LED at one frequency for CONFIG_APP_SIM_BLINK_MS and prints how far the
+ *        toggles were from their schedule
+ */
+static void _sim_blink_schedule(led_frequency frequency) {
+  char name[SIM_NAME_SIZE];
+  char what[64];
+
+  LED_set_mask(LED_ALL_MASK, 0);
+  memset(_sim.leds, 0, sizeof(_sim.leds));
+  memset(&_sim.blink_err_us, 0, sizeof(_sim.blink_err_us));
+  _sim.blink_half_period_us = SIM_HALF_PERIOD_US / frequency;
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    LED_blink(i, frequency);
+  }
+  k_msleep(CONFIG_APP_SIM_BLINK_MS);
+  _sim.blink_half_period_us = 0;
+  LED_set_mask(LED_ALL_MASK, 0);
+
+  snprintk(name, sizeof(name), "blink_%dhz_toggles", frequency);
+  _sim_print(name, _sim.blink_err_us.count, "toggles");
+  snprintk(name, sizeof(name), "blink_%dhz_err_mean", frequency);
+  _sim_print(name, _sim.blink_err_us.count ? _sim.blink_err_us.sum / _sim.blink_err_us.count : 0, "us");
+  snprintk(name, sizeof(name), "blink_%dhz_err_max", frequency);
+  _sim_print(name, _sim.blink_err_us.max, "us");
+
+  if (0 == _sim.blink_err_us.count) {
+    snprintk(what, sizeof(what), "%d Hz blink never toggled", frequency);
+    _sim_fail(what);
+  } else if (_sim.blink_err_us.max > SIM_BLINK_TOLERANCE_US) {
+    snprintk(what, sizeof(what), "%d Hz blink toggled %u us off schedule", frequency, _sim.blink_err_us.max);
+    _sim_fail(what);
+  }
+}
+
+/**
+ * @brief Reads the emulated channel of an LED, all zero if it can't be read
+ */
+static pwm_emul_channel _sim_channel(led_id led) {
+  pwm_emul_channel state = {0};
+
+  PWM_EMUL_get_channel(_sim_led_specs[led].dev, _sim_led_specs[led].channel, &state);
+  return state;
+}
+
+/**
+ * @brief Reads how long an LED is on each period, the LED driver writes the active low pulse
+ */
+static uint32_t _sim_on_cycles(led_id led) {
+  pwm_emul_channel state = _sim_channel(led);
+
+  return state.period_cycles - state.pulse_cycles;
+}
+
+/**
+ * @brief Sums the pwm_set calls on every LED channel
+ */
+static uint32_t _sim_total_writes(void) {
+  uint32_t writes = 0;
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    pwm_emul_channel state;
+    if (0 == PWM_EMUL_get_channel(_sim_led_specs[i].dev, _sim_led_specs[i].channel, &state)) {
+      writes += state.writes;
+    }
+  }
+  return writes;
+}
+
+/**
+ * @brief Prints how many PWM writes the static LED calls cost, in thousandths of a write per call
+ */
+static void _sim_write_counts(void) {
+  uint32_t writes;
+
+  LED_set_mask(LED_ALL_MASK, 0);
+
+  writes = _sim_total_writes();
+  for (int call = 0; call < SIM_CALLS; call++) {
+    LED_pwm(LED0, 1 + call % 100);
+  }
+  _sim_print("led_pwm_writes", (_sim_total_writes() - writes) * 1000ULL / SIM_CALLS, "milli_per_call");
+
+  writes = _sim_total_writes();
+  for (int call = 0; call < SIM_CALLS; call++) {
+    LED_set(LED0, LED_ON);
+  }
+  _sim_print("led_set_same_writes", (_sim_total_writes() - writes) * 1000ULL / SIM_CALLS, "milli_per_call");
+
+  writes = _sim_total_writes();
+  for (int call = 0; call < SIM_CALLS; call++) {
+    LED_set_mask(LED_ALL_MASK, (call & 1) ? LED_ALL_MASK : 0);
+  }
+  _sim_print("led_set_mask_writes", (_sim_total_writes() - writes) * 1000ULL / SIM_CALLS, "milli_per_call");
+
+  LED_set_mask(LED_ALL_MASK, 0);
+}
+
+/**
+ * @brief Checks the LED PWM is suspended once every LED is off
+ */
+static void _sim_pm(void) {
+#if defined(CONFIG_LED_PM)
+  bool suspended = true;
+
+  LED_set_mask(LED_ALL_MASK, 0);
+  for (int i = 0; i < NUM_LEDS; i++) {
+    suspended = suspended && PWM_EMUL_is_suspended(_sim_led_specs[i].dev);
+  }
+  _sim_print("pwm_suspended_when_off", suspended, "bool");
+  if (!suspended) {
+    _sim_fail("LED PWM still running with every LED off");
+  }
+#endif
+}
+
+#if defined(CONFIG_LED_ASYNC)
+/**
+ * @brief Queues the rest of the async burst from the timer interrupt, where only the async calls are safe
+ */
+static void _sim_async_expiry(struct k_timer *timer) {
+  ARG_UNUSED(timer);
+
+  for (int i = SIM_ASYNC_MAIN_COMMANDS; i < CONFIG_LED_ASYNC_QUEUE_SIZE; i++) {
+    _sim.async_rejected += (0 != LED_pwm_async(LED0, i + 1));
+  }
+}
+#endif
+
+/**
+ * @brief Fills the async command ring from the sim thread and a timer interrupt, checks one more
+ *        command is refused and the engine then runs every queued command in order
+ */
+static void _sim_async(void) {
+#if defined(CONFIG_LED_ASYNC)
+  bool expired;
+  int rv;
+
+  LED_set_mask(LED_ALL_MASK, 0);
+  k_timer_init(&_sim.async_timer, _sim_async_expiry, NULL);
+  _sim.async_changes = 0;
+  _sim.async_on_cycles = 0;
+  _sim.async_reordered = 0;
+  _sim.async_rejected = 0;
+  _sim.async_tracked = true;
+
+  // The engine drains the ring from a thread on every backend, so nothing is taken off it until the unlock
+  k_sched_lock();
+  for (int i = 0; i < SIM_ASYNC_MAIN_COMMANDS; i++) {
+    _sim.async_rejected += (0 != LED_pwm_async(LED0, i + 1));
+  }
+  k_timer_start(&_sim.async_timer, K_TICKS(1), K_NO_WAIT);
+  k_busy_wait(3 * SIM_TICK_US);
+  expired = (0 < k_timer_status_get(&_sim.async_timer));
+  rv = LED_pwm_async(LED0, CONFIG_LED_ASYNC_QUEUE_SIZE + 1);
+  k_sched_unlock();
+
+  k_msleep(SIM_SETTLE_MS);
+  _sim.async_tracked = false;
+  LED_set_mask(LED_ALL_MASK, 0);
+
+  _sim_print("async_from_timer", expired, "bool");
+  _sim_print("async_rejected", _sim.async_rejected, "commands");
+  _sim_print("async_full_eagain", -EAGAIN == rv, "bool");
+  _sim_print("async_applied", _sim.async_changes, "commands");
+  _sim_print("async_reordered", _sim.async_reordered, "commands");
+
+  if (!expired) {
+    _sim_fail("async timer never expired");
+  } else if (0 != _sim.async_rejected) {
+    _sim_fail("async ring refused a command before it was full");
+  } else if (-EAGAIN != rv) {
+    _sim_fail("async ring took a command past CONFIG_LED_ASYNC_QUEUE_SIZE");
+  } else if (CONFIG_LED_ASYNC_QUEUE_SIZE != _sim.async_changes || 0 != _sim.async_reordered) {
+    _sim_fail("async commands were not all run in the order queued");
+  }
+#endif
+}
+
+/**
+ * @brief Stacks requests on the lowest and highest layer of LED0, checks the highest one is shown,
+ *        a change below it costs no PWM write and releasing both hands back the base duty cycle
+ */
+static void _sim_layers(void) {
+#if defined(CONFIG_LED_LAYERS) && CONFIG_LED_NUM_LAYERS > 1
+  const led_layer low = 0;
+  const led_layer high = CONFIG_LED_NUM_LAYERS - 1;
+  uint32_t base_on, low_on, high_on, writes, changes;
+  bool high_wins, restored;
+
+  LED_set_mask(LED_ALL_MASK, 0);
+  LED_pwm(LED0, SIM_LAYER_BASE_DUTY);
+  base_on = _sim_on_cycles(LED0);
+
+  LED_layer_set(low, LED0, 60);
+  low_on = _sim_on_cycles(LED0);
+  LED_layer_set(high, LED0, 90);
+  high_on = _sim_on_cycles(LED0);
+
+  writes = _sim_channel(LED0).writes;
+  LED_layer_set(low, LED0, 10);
+  LED_layer_blink_ms(low, LED0, SIM_LAYER_BLINK_MS, SIM_LAYER_BLINK_MS);
+  writes = _sim_channel(LED0).writes - writes;
+  high_wins = base_on < low_on && low_on < high_on && high_on == _sim_on_cycles(LED0);
+
+  // The blink left on the low layer takes over
+  LED_layer_release(high, BIT(LED0));
+  changes = _sim_channel(LED0).changes;
+  k_msleep(4 * SIM_LAYER_BLINK_MS + SIM_LAYER_BLINK_MS / 2);
+  changes = _sim_channel(LED0).changes - changes;
+
+  LED_layer_release(low, BIT(LED0));
+  restored = base_on == _sim_on_cycles(LED0);
+  LED_set_mask(LED_ALL_MASK, 0);
+
+  _sim_print("layer_high_wins", high_wins, "bool");
+  _sim_print("layer_low_change_writes", writes, "writes");
+  _sim_print("layer_blink_toggles", changes, "toggles");
+  _sim_print("layer_release_restores", restored, "bool");
+
+  if (!high_wins) {
+    _sim_fail("LED0 did not show its highest layer");
+  } else if (0 != writes) {
+    _sim_fail("a change below the shown layer wrote the PWM");
+  } else if (changes < 2) {
+    _sim_fail("the low layer blink did not run once the high layer was released");
+  } else if (!restored) {
+    _sim_fail("releasing the last layer did not restore the base duty cycle");
+  }
+#endif
+}
+
+/**
+ * @brief Limits the brightness of LED0, checks a steady LED is rewritten at the limit and a blink
+ *        that was already running tops out at it
+ */
+static void _sim_max_duty_cycle(void) {
+#if defined(CONFIG_LED_SETTINGS)
+  // Stored by an earlier run of the same flash image, put back once done
+  int saved = LED_get_max_duty_cycle(LED0);
+  uint32_t scaled_on, limit_on;
+  bool steady_limited, blink_limited;
+
+  LED_set_mask(LED_ALL_MASK, 0);
+  LED_set_max_duty_cycle(LED0, SIM_FULL_DUTY);
+  LED_pwm(LED0, SIM_LIMIT_DUTY * SIM_LIMIT_DUTY / SIM_FULL_DUTY);
+  scaled_on = _sim_on_cycles(LED0);
+  LED_pwm(LED0, SIM_LIMIT_DUTY);
+  limit_on = _sim_on_cycles(LED0);
+
+  // LED0 is left steady at SIM_LIMIT_DUTY, the limit scales it down to scaled_on
+  LED_set_max_duty_cycle(LED0, SIM_LIMIT_DUTY);
+  steady_limited = scaled_on == _sim_on_cycles(LED0);
+
+  LED_set_max_duty_cycle(LED0, SIM_FULL_DUTY);
+  LED_blink(LED0, LED_4HZ);
+  k_msleep(SIM_HALF_PERIOD_US / LED_4HZ / USEC_PER_MSEC);
+  LED_set_max_duty_cycle(LED0, SIM_LIMIT_DUTY);
+  _sim.limit_peak_on_cycles = 0;
+  _sim.limit_tracked = true;
+  k_msleep(4 * SIM_HALF_PERIOD_US / LED_4HZ / USEC_PER_MSEC);
+  _sim.limit_tracked = false;
+  blink_limited = limit_on == _sim.limit_peak_on_cycles;
+
+  LED_set_mask(LED_ALL_MASK, 0);
+  LED_set_max_duty_cycle(LED0, (0 > saved) ? SIM_FULL_DUTY : saved);
+
+  _sim_print("limit_steady_scaled", steady_limited, "bool");
+  _sim_print("limit_blink_on", _sim.limit_peak_on_cycles, "cycles");
+  _sim_print("limit_blink_expected_on", limit_on, "cycles");
+
+  if (!steady_limited) {
+    _sim_fail("a steady LED was not rewritten at its new brightness limit");
+  } else if (!blink_limited) {
+    _sim_fail("a running blink did not top out at its new brightness limit");
+  }
+#endif
+}
+
+/**
+ * @brief Throws away every queued button event, so a check leaves none for the next one
+ */
+static void _sim_drop_events(void) {
+  btn_event event;
+
+  while (0 == BTN_get_event(&event, K_NO_WAIT)) {
+  }
+}
+
+/**
+ * @brief Binds LED1 to follow BTN0, checks it lights while an injected press is held and goes
+ *        dark on release with nothing but the button driver handling the press
+ */
+static void _sim_led_binding(void) {
+#if defined(CONFIG_BTN_LED_BINDING)
+  bool held_on, released_off;
+
+  LED_set_mask(LED_ALL_MASK, 0);
+  BTN_bind_led_action(BTN0, LED1, BTN_LED_FOLLOW);
+
+  _sim_bounce(BTN0, true);
+  k_msleep(SIM_SETTLE_MS);
+  held_on = _sim_channel(LED1).period_cycles == _sim_on_cycles(LED1);
+  _sim_bounce(BTN0, false);
+  k_msleep(SIM_SETTLE_MS);
+  released_off = 0 == _sim_on_cycles(LED1);
+
+  BTN_bind_led_action(BTN0, LED1, BTN_LED_NONE);
+  k_msleep(SIM_GESTURE_QUIET_MS);
+  _sim_drop_events();
+  LED_set_mask(LED_ALL_MASK, 0);
+
+  _sim_print("binding_follow_held_on", held_on, "bool");
+  _sim_print("binding_follow_released_off", released_off, "bool");
+
+  if (!held_on || !released_off) {
+    _sim_fail("LED1 did not follow BTN0 through its binding");
+  }
+#endif
+}
+
+/**
+ * @brief Checks BTN_wait times out with no press and wakes for a press that settles while it sleeps
+ */
+static void _sim_wait(void) {
+  const k_timeout_t timeout = K_MSEC(4 * SIM_SETTLE_MS);
+  uint32_t idle_mask, pressed_mask;
+  int64_t idle_ms, pressed_ms;
+  int64_t start_ms;
+
+  // Clears the presses earlier checks left behind
+  BTN_wait(BTN_ALL_MASK, K_NO_WAIT);
+
+  start_ms = k_uptime_get();
+  idle_mask = BTN_wait(BIT(BTN1), timeout);
+  idle_ms = k_uptime_get() - start_ms;
+
+  // The debounce of the press ends while BTN_wait sleeps
+  _sim_bounce(BTN1, true);
+  start_ms = k_uptime_get();
+  pressed_mask = BTN_wait(BIT(BTN1), timeout);
+  pressed_ms = k_uptime_get() - start_ms;
+  _sim_bounce(BTN1, false);
+
+  k_msleep(SIM_GESTURE_QUIET_MS);
+  _sim_drop_events();
+  BTN_wait(BTN_ALL_MASK, K_NO_WAIT);
+
+  _sim_print("wait_idle_mask", idle_mask, "mask");
+  _sim_print("wait_idle_time", idle_ms, "ms");
+  _sim_print("wait_pressed_mask", pressed_mask, "mask");
+  _sim_print("wait_pressed_time", pressed_ms, "ms");
+
+  if (0 != idle_mask || idle_ms < 4 * SIM_SETTLE_MS) {
+    _sim_fail("BTN_wait returned before its timeout with no press");
+  } else if (BIT(BTN1) != pressed_mask || pressed_ms >= 4 * SIM_SETTLE_MS) {
+    _sim_fail("BTN_wait did not wake for a press");
+  }
+}
+
+/**
+ * @brief Lengthens the debounce of BTN2, checks a press that settles for the default debounce
+ *        is now ignored and a longer one is taken no earlier than the new time
+ */
+static void _sim_debounce_ms(void) {
+  const uint32_t debounce_ms = 2 * SIM_SETTLE_MS;
+  uint32_t short_mask, long_mask;
+  int64_t long_ms;
+  int64_t start_ms;
+
+  if (0 != BTN_set_debounce_ms(BTN2, debounce_ms)) {
+    // The integrating debounce counts samples rather than time
+    return;
+  }
+  BTN_wait(BIT(BTN2), K_NO_WAIT);
+
+  _sim_hold(BTN2, SIM_SETTLE_MS);
+  short_mask = BTN_wait(BIT(BTN2), K_MSEC(debounce_ms + SIM_SETTLE_MS));
+
+  _sim_bounce(BTN2, true);
+  start_ms = k_uptime_get();
+  long_mask = BTN_wait(BIT(BTN2), K_MSEC(debounce_ms + SIM_SETTLE_MS));
+  long_ms = k_uptime_get() - start_ms;
+  _sim_bounce(BTN2, false);
+
+  k_msleep(SIM_GESTURE_QUIET_MS + debounce_ms);
+  BTN_set_debounce_ms(BTN2, CONFIG_BTN_DEBOUNCE_MS);
+  _sim_drop_events();
+  BTN_wait(BTN_ALL_MASK, K_NO_WAIT);
+
+  _sim_print("debounce_set_short_mask", short_mask, "mask");
+  _sim_print("debounce_set_long_mask", long_mask, "mask");
+  _sim_print("debounce_set_long_time", long_ms, "ms");
+
+  if (0 != short_mask) {
+    _sim_fail("a press shorter than the BTN_set_debounce_ms time was taken");
+  } else if (BIT(BTN2) != long_mask || long_ms < debounce_ms) {
+    _sim_fail("a press was not taken after the BTN_set_debounce_ms time");
+  }
+}
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Runs the simulation once, call after BTN_init and LED_init. Nothing else may read
+ *        button events or drive the LEDs until it returns
+ */
+void sim_run() {
+  static const led_frequency frequencies[] = {LED_1HZ, LED_2HZ, LED_4HZ, LED_8HZ, LED_16HZ};
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    PWM_EMUL_set_callback(_sim_led_specs[i].dev, _sim_on_pwm_write);
+  }
+
+  _sim_presses();
+  for (size_t i = 0; i < ARRAY_SIZE(frequencies); i++) {
+    _sim_blink_schedule(frequencies[i]);
+  }
+  _sim_write_counts();
+  _sim_pm();
+  _sim_async();
+  _sim_layers();
+  _sim_max_duty_cycle();
+  _sim_led_binding();
+  _sim_wait();
+  _sim_debounce_ms();
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    PWM_EMUL_set_callback(_sim_led_specs[i].dev, NULL);
+  }
+
+  _sim_print("failures", _sim.failures, "checks");
+  printk("SIM,done,%s\n", _sim.failures ? "fail" : "pass");
+}
@@ -0,0 +1,13 @@
+/*
+Header to define the native_sim driver simulation
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+void sim_run();
+
+#endif
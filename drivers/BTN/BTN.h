@@ -6,23 +6,88 @@ Header to define button interface
 #define BTN_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include <zephyr/devicetree.h>
+
+#if defined(CONFIG_BTN_LED_BINDING)
+#include "LED.h"
+#endif
 
 /* ----------------------------------------------------------------------------
                                     TYPES
 ---------------------------------------------------------------------------- */
+#define BTN_DT_NODE   DT_COMPAT_GET_ANY_STATUS_OKAY(gpio_keys)
+#define NUM_BTNS      DT_CHILD_NUM_STATUS_OKAY(BTN_DT_NODE) // One button per okay gpio-keys child
+
+// BTNx is the x-th okay child of the gpio-keys node, only ids below NUM_BTNS exist on a board
 typedef enum btn_id_t {
   BTN0 = 0,
   BTN1,
   BTN2,
   BTN3,
-  NUM_BTNS,
+  BTN4,
+  BTN5,
+  BTN6,
+  BTN7,
+  BTN8,
+  BTN9,
+  BTN10,
+  BTN11,
+  BTN12,
+  BTN13,
+  BTN14,
+  BTN15,
 } btn_id;
 
+#define BTN_ALL_MASK ((uint32_t)((1ULL << NUM_BTNS) - 1)) // Bitmask of every button
+
+typedef enum btn_event_type_t {
+  BTN_EVENT_PRESS = 0,
+  BTN_EVENT_RELEASE,
+  BTN_EVENT_LONG_PRESS, // Held for CONFIG_BTN_LONG_PRESS_MS
+  BTN_EVENT_MULTI_CLICK, // Two or more clicks, each within CONFIG_BTN_MULTI_CLICK_MS of the last
+} btn_event_type;
+
+typedef struct btn_event_t {
+  uint32_t cycles; // k_cycle_get_32() at the first edge of a press or release, wraps
+  uint8_t btn; // btn_id of the button
+  uint8_t type; // btn_event_type
+  uint8_t clicks; // Clicks in the multi-click sequence so far, 1 for a single press
+} btn_event;
+
+typedef void (*btn_event_callback)(const btn_event *event);
+
+#if defined(CONFIG_BTN_LED_BINDING)
+typedef enum btn_led_action_t {
+  BTN_LED_NONE = 0,
+  BTN_LED_TOGGLE, // Toggles the LED on every press
+  BTN_LED_ON, // Turns the LED on on every press
+  BTN_LED_OFF, // Turns the LED off on every press
+  BTN_LED_FOLLOW, // LED is on while the button is held down
+  NUM_BTN_LED_ACTIONS,
+} btn_led_action;
+#endif
+
 /* ----------------------------------------------------------------------------
                               Public Functions
 ---------------------------------------------------------------------------- */
 int BTN_init();
 
+int BTN_get_event(btn_event *event, k_timeout_t timeout);
+
+uint32_t BTN_wait(uint32_t btn_mask, k_timeout_t timeout);
+
+void BTN_set_event_callback(btn_event_callback callback);
+
+void BTN_set_event_queueing(bool enable);
+
+int BTN_set_debounce_ms(btn_id btn, uint32_t debounce_ms);
+
+#if defined(CONFIG_BTN_LED_BINDING)
+int BTN_bind_led_action(btn_id btn, led_id led, btn_led_action action);
+#endif
+
 bool BTN_is_pressed(btn_id btn);
 
 bool BTN_check_clear_pressed(btn_id btn);
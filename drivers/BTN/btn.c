@@ -8,50 +8,188 @@ Header to define button module logic
 #include <zephyr/sys/printk.h>
 #include <inttypes.h>
 
+#if defined(CONFIG_BTN_TRACE)
+#include <zephyr/tracing/tracing.h>
+#endif
+
+#if defined(CONFIG_BTN_SETTINGS)
+#include <string.h>
+#include <zephyr/settings/settings.h>
+#endif
+
 #include "BTN.h"
+#include "LATENCY.h"
 
 /* ----------------------------------------------------------------------------
                                     Constants
 ---------------------------------------------------------------------------- */
-#define BTN_DEBOUNCE_MS   20
+#define BTN_DEBOUNCE_MAX_MS   60000
+
+#define BTN_SETTINGS_KEY      "btn/cfg"
+#define BTN_SETTINGS_VERSION  1 // Bump on any change to btn_settings, older records are ignored
+
+#define BTN_PORT_PINS     32 // Pins a gpio_port_pins_t can describe
+#define BTN_MAX_PORTS     NUM_BTNS // Worst case every button sits on its own port
 
 /* ----------------------------------------------------------------------------
                                   Macro Helpers
 ---------------------------------------------------------------------------- */
-#define BTN0_NODE             DT_ALIAS(sw0)
-#define BTN1_NODE             DT_ALIAS(sw1)
-#define BTN2_NODE             DT_ALIAS(sw2)
-#define BTN3_NODE             DT_ALIAS(sw3)
-
 #define IS_INVALID_BTN(btn)   (btn >= NUM_BTNS || btn < 0)
 
+#define BTN_BINDING(led, action)    ((uint16_t)(((action) << 8) | (led)))
+#define BTN_BINDING_LED(binding)    ((led_id)((binding) & 0xFF))
+#define BTN_BINDING_ACTION(binding) ((btn_led_action)((binding) >> 8))
+
+#if defined(CONFIG_BTN_TRACE)
+// A name and two words, stamped by the tracing backend alongside the kernel events
+#define BTN_TRACE(name, arg0, arg1)  sys_trace_named_event((name), (uint32_t)(arg0), (uint32_t)(arg1))
+#else
+#define BTN_TRACE(name, arg0, arg1)  do { } while (0)
+#endif
+
+#define BTN_DT_SPEC(node_id)  GPIO_DT_SPEC_GET(node_id, gpios),
+
 /* ----------------------------------------------------------------------------
                                     Types
 ---------------------------------------------------------------------------- */
 typedef struct btn_gpio_t {
-  struct gpio_dt_spec spec; 
-  volatile bool pressed;
-  struct gpio_callback cb;
+#if defined(CONFIG_BTN_DEBOUNCE_WORK)
   struct k_work_delayable work;
+#elif defined(CONFIG_BTN_DEBOUNCE_SHARED)
+  k_ticks_t quiet_deadline; // Absolute uptime in ticks the button counts as settled at
+#endif
+  uint32_t debounce_ticks; // Quiet time the button needs after an edge
+  struct k_work_delayable gesture; // Times out long presses and multi-click sequences
+  uint32_t edge_cycles; // Cycle count of the first edge of the current bounce burst
+  int64_t release_ms; // Uptime of the last debounced release
+  uint8_t clicks; // Clicks in the current multi-click sequence
+  bool level; // Debounced state, true while held down
+  bool long_pressed; // The current hold already reported a long press
+#if defined(CONFIG_BTN_LED_BINDING)
+  uint16_t binding; // BTN_BINDING of the bound LED and action, one store so it never tears
+#endif
 } btn_gpio;
 
+#if defined(CONFIG_BTN_SETTINGS)
+// Stored as one settings record, packed so its size and layout only change with a version bump
+typedef struct __packed btn_settings_t {
+  uint8_t version;
+  uint16_t debounce_ms[NUM_BTNS];
+  uint16_t bindings[NUM_BTNS]; // BTN_BINDING of each button, 0 when unbound
+} btn_settings;
+#endif
+
+typedef struct btn_port_t {
+  const struct device *port;
+  struct gpio_callback cb; // Covers every button pin of the port
+  uint8_t pin_to_btn[BTN_PORT_PINS]; // Button on each pin in cb.pin_mask
+  uint32_t btn_mask; // Buttons on the port
+#if defined(CONFIG_BTN_DEBOUNCE_INTEGRATOR)
+  gpio_port_pins_t active_low; // Button pins that read 0 while pressed
+  gpio_port_value_t state; // Debounced level of every pin, 1 while pressed
+  gpio_port_value_t count0; // Low bit of the per pin sample counters
+  gpio_port_value_t count1; // High bit of the per pin sample counters
+#endif
+} btn_port;
+
+#if defined(CONFIG_BTN_DEBOUNCE_SHARED)
+typedef struct btn_debouncer_t {
+  struct k_timer timer; // Armed for the earliest quiet deadline
+  struct k_work settle; // Samples the settled buttons from the system workqueue
+  struct k_spinlock lock; // Shared by the GPIO and timer interrupts
+  uint32_t bouncing_mask; // Buttons with an edge inside their debounce time
+  uint32_t settled_mask; // Buttons waiting for the settle work
+  k_ticks_t armed_deadline; // Deadline the timer is armed for, INT64_MAX when idle
+} btn_debouncer;
+#elif defined(CONFIG_BTN_DEBOUNCE_INTEGRATOR)
+typedef struct btn_debouncer_t {
+  struct k_timer timer; // Samples every port while sampling is set
+  struct k_work settle; // Reports the changed buttons from the system workqueue
+  struct k_spinlock lock; // Shared by the GPIO and timer interrupts
+  uint32_t bouncing_mask; // Buttons that moved since they last agreed with their state
+  uint32_t settled_mask; // Buttons that changed state, waiting for the settle work
+  uint32_t level_mask; // Debounced level of the buttons in settled_mask
+  bool sampling;
+} btn_debouncer;
+#endif
+
 /* ----------------------------------------------------------------------------
                             Private Function Prototypes
 ---------------------------------------------------------------------------- */
-static int _btn_config(btn_gpio *btn);
+static int _btn_config(btn_id btn);
 
 static void _btn_interrupt_service_routine(const struct device *dev, struct gpio_callback *cb, uint32_t pins);
 
+#if defined(CONFIG_BTN_DEBOUNCE_WORK)
 static void _btn_debounce(struct k_work *work);
+#elif defined(CONFIG_BTN_DEBOUNCE_SHARED)
+static void _btn_debounce_expiry(struct k_timer *timer);
+
+static void _btn_debounce_settle(struct k_work *work);
+#elif defined(CONFIG_BTN_DEBOUNCE_INTEGRATOR)
+static bool _btn_integrate(btn_port *port, gpio_port_value_t sample);
+
+static void _btn_debounce_sample(struct k_timer *timer);
+
+static void _btn_debounce_settle(struct k_work *work);
+#endif
+
+static void _btn_settle(btn_id btn, bool level);
+
+static void _btn_gesture(struct k_work *work);
+
+#if defined(CONFIG_BTN_LED_BINDING)
+static void _btn_apply_binding(btn_gpio *btn, bool level);
+#endif
+
+static void _btn_post(btn_id btn, btn_event_type type, uint32_t cycles, uint8_t clicks);
+
+#if defined(CONFIG_BTN_SETTINGS)
+static int _btn_settings_read(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param);
+
+static void _btn_settings_load(void);
+
+static void _btn_settings_changed(void);
+
+static void _btn_settings_save(struct k_work *work);
+#endif
 
 /* ----------------------------------------------------------------------------
                                 Global States
 ---------------------------------------------------------------------------- */
-static btn_gpio _btn0 = {.spec=GPIO_DT_SPEC_GET(BTN0_NODE, gpios), .pressed=false};
-static btn_gpio _btn1 = {.spec=GPIO_DT_SPEC_GET(BTN1_NODE, gpios), .pressed=false};
-static btn_gpio _btn2 = {.spec=GPIO_DT_SPEC_GET(BTN2_NODE, gpios), .pressed=false};
-static btn_gpio _btn3 = {.spec=GPIO_DT_SPEC_GET(BTN3_NODE, gpios), .pressed=false};
-static btn_gpio *_btns[NUM_BTNS] = {&_btn0, &_btn1, &_btn2, &_btn3};
+BUILD_ASSERT(NUM_BTNS > 0 && NUM_BTNS <= 16, "btn_id stops at BTN15");
+
+// One entry per okay child of the gpio-keys node, in devicetree order
+static const struct gpio_dt_spec _btn_specs[NUM_BTNS] = {
+  DT_FOREACH_CHILD_STATUS_OKAY(BTN_DT_NODE, BTN_DT_SPEC)
+};
+
+static btn_gpio _btns[NUM_BTNS];
+
+static btn_port _btn_ports[BTN_MAX_PORTS];
+static uint8_t _btn_num_ports = 0;
+
+#if defined(CONFIG_BTN_DEBOUNCE_SHARED)
+static btn_debouncer _btn_debouncer = {.bouncing_mask=0, .settled_mask=0, .armed_deadline=INT64_MAX};
+#elif defined(CONFIG_BTN_DEBOUNCE_INTEGRATOR)
+static btn_debouncer _btn_debouncer = {.bouncing_mask=0, .settled_mask=0, .level_mask=0, .sampling=false};
+#endif
+
+K_MSGQ_DEFINE(_btn_event_queue, sizeof(btn_event), CONFIG_BTN_EVENT_QUEUE_SIZE, 4);
+
+static btn_event_callback _btn_event_cb = NULL;
+static bool _btn_queueing = true; // Off once a consumer takes every event from the callback
+
+// BIT(btn) is posted on every debounced press and stays set until checked or waited on
+K_EVENT_DEFINE(_btn_pressed_events);
+
+#if defined(CONFIG_BTN_SETTINGS)
+static btn_settings _btn_settings; // What the buttons run with, saved CONFIG_BTN_SETTINGS_SAVE_DELAY_MS after a change
+static btn_settings _btn_settings_saved; // The stored record, a save that matches it is skipped
+static struct k_spinlock _btn_settings_lock;
+
+static K_WORK_DELAYABLE_DEFINE(_btn_settings_work, _btn_settings_save);
+#endif
 
 /* ----------------------------------------------------------------------------
                               Private Functions
@@ -59,55 +197,528 @@ static btn_gpio *_btns[NUM_BTNS] = {&_btn0, &_btn1, &_btn2, &_btn3};
 /**
  * @brief Configures a gpio spec as a button
  * 
- * @param [in] btn the btn_gpio object to configure
+ * @param [in] btn the button to configure
  * 
  * @return Error code, < 0 on failures
  */
-static int _btn_config(btn_gpio *btn) {
-  if (!gpio_is_ready_dt(&btn->spec)) {
+static int _btn_config(btn_id btn) {
+  const struct gpio_dt_spec *spec = &_btn_specs[btn];
+
+  if (!gpio_is_ready_dt(spec)) {
 		return -EIO;
-	} else if (0 > gpio_pin_configure_dt(&btn->spec, GPIO_INPUT)) {
+	} else if (0 > gpio_pin_configure_dt(spec, GPIO_INPUT)) {
 		return -EIO;
-  } else if (0 > gpio_pin_interrupt_configure_dt(&btn->spec, GPIO_INT_EDGE_TO_ACTIVE)) {
+  } else if (0 > gpio_pin_interrupt_configure_dt(spec, GPIO_INT_EDGE_BOTH)) {
 		return -EIO;
-  } else {
-    gpio_init_callback(&btn->cb, _btn_interrupt_service_routine, BIT(btn->spec.pin));
-    gpio_add_callback(btn->spec.port, &btn->cb);
-    k_work_init_delayable(&btn->work, _btn_debounce);
-    return 0;
   }
+
+  btn_port *port = NULL;
+  for (uint8_t i = 0; i < _btn_num_ports; i++) {
+    if (spec->port == _btn_ports[i].port) {
+      port = &_btn_ports[i];
+    }
+  }
+  if (NULL == port) {
+    port = &_btn_ports[_btn_num_ports++];
+    port->port = spec->port;
+    gpio_init_callback(&port->cb, _btn_interrupt_service_routine, 0);
+  }
+
+  // The callback is registered once all pins of its port are in the mask
+  port->cb.pin_mask |= BIT(spec->pin);
+  port->pin_to_btn[spec->pin] = btn;
+  port->btn_mask |= BIT(btn);
+#if defined(CONFIG_BTN_DEBOUNCE_WORK)
+  k_work_init_delayable(&_btns[btn].work, _btn_debounce);
+#elif defined(CONFIG_BTN_DEBOUNCE_INTEGRATOR)
+  if (spec->dt_flags & GPIO_ACTIVE_LOW) {
+    port->active_low |= BIT(spec->pin);
+  }
+  if (gpio_pin_get_dt(spec) > 0) {
+    port->state |= BIT(spec->pin);
+  }
+  // Counters rest at their top value, four differing samples in a row wrap them
+  port->count0 |= BIT(spec->pin);
+  port->count1 |= BIT(spec->pin);
+#endif
+  _btns[btn].debounce_ticks = k_ms_to_ticks_ceil32(CONFIG_BTN_DEBOUNCE_MS);
+  k_work_init_delayable(&_btns[btn].gesture, _btn_gesture);
+  _btns[btn].level = gpio_pin_get_dt(spec) > 0;
+  return 0;
 }
 
 /**
- * @brief Invoked as an interrupt when a button goes to the active state (high)
+ * @brief Invoked as an interrupt on every edge of a button, timestamps the edge that starts a burst
  * 
  * @param [in] dev The GPIO port that triggered the interrupt
  * @param [in] cb A pointer to the registered callback structure for this ISR
  * @param [in] pins A bitmask for all the GPIO pins that triggered this interrupt
  */
 static void _btn_interrupt_service_routine(const struct device *dev, struct gpio_callback *cb, uint32_t pins) {
-  for (uint8_t i = 0; i < NUM_BTNS; i++) {
-    if (pins & BIT(_btns[i]->spec.pin)) {
-      k_work_reschedule(&_btns[i]->work, K_MSEC(BTN_DEBOUNCE_MS));
+  btn_port *port = CONTAINER_OF(cb, btn_port, cb);
+
+  // Only visits the pins that fired, independent of how many buttons there are
+  pins &= cb->pin_mask;
+  uint32_t cycles = k_cycle_get_32();
+  BTN_TRACE("btn_isr", pins, 0);
+#if defined(CONFIG_BTN_DEBOUNCE_WORK)
+  while (pins) {
+    uint32_t pin = __builtin_ctz(pins);
+    btn_gpio *btn = &_btns[port->pin_to_btn[pin]];
+    pins &= pins - 1;
+    if (!k_work_delayable_is_pending(&btn->work)) {
+      // Later bounces only push the debounce back, the press happened on the first edge
+      btn->edge_cycles = cycles;
+      LATENCY_PROBE(LATENCY_BTN_EDGE, port->pin_to_btn[pin]);
+    }
+    k_work_reschedule(&btn->work, K_TICKS(btn->debounce_ticks));
+  }
+#elif defined(CONFIG_BTN_DEBOUNCE_SHARED)
+  k_spinlock_key_t key = k_spin_lock(&_btn_debouncer.lock);
+  k_ticks_t now = k_uptime_ticks();
+  k_ticks_t earliest = INT64_MAX;
+  while (pins) {
+    uint32_t pin = __builtin_ctz(pins);
+    uint8_t id = port->pin_to_btn[pin];
+    btn_gpio *btn = &_btns[id];
+    pins &= pins - 1;
+    if (!(_btn_debouncer.bouncing_mask & BIT(id))) {
+      // Later bounces only push the deadline back, the press happened on the first edge
+      btn->edge_cycles = cycles;
+      _btn_debouncer.bouncing_mask |= BIT(id);
+      LATENCY_PROBE(LATENCY_BTN_EDGE, id);
+    }
+    btn->quiet_deadline = now + btn->debounce_ticks;
+    earliest = MIN(earliest, btn->quiet_deadline);
+  }
+  // A deadline pushed back is found by the expiry already armed, only an earlier one restarts it
+  if (earliest < _btn_debouncer.armed_deadline) {
+    _btn_debouncer.armed_deadline = earliest;
+    k_timer_start(&_btn_debouncer.timer, K_TIMEOUT_ABS_TICKS(earliest), K_NO_WAIT);
+  }
+  k_spin_unlock(&_btn_debouncer.lock, key);
+#elif defined(CONFIG_BTN_DEBOUNCE_INTEGRATOR)
+  k_spinlock_key_t key = k_spin_lock(&_btn_debouncer.lock);
+  while (pins) {
+    uint32_t pin = __builtin_ctz(pins);
+    uint8_t id = port->pin_to_btn[pin];
+    pins &= pins - 1;
+    if (!(_btn_debouncer.bouncing_mask & BIT(id))) {
+      _btns[id].edge_cycles = cycles;
+      _btn_debouncer.bouncing_mask |= BIT(id);
+      LATENCY_PROBE(LATENCY_BTN_EDGE, id);
     }
   }
+  // Edges only wake the sampler, the samples decide the state
+  if (!_btn_debouncer.sampling) {
+    _btn_debouncer.sampling = true;
+    k_timer_start(&_btn_debouncer.timer, K_MSEC(CONFIG_BTN_DEBOUNCE_SAMPLE_MS), K_MSEC(CONFIG_BTN_DEBOUNCE_SAMPLE_MS));
+  }
+  k_spin_unlock(&_btn_debouncer.lock, key);
+#endif
   return;
 }
 
+#if defined(CONFIG_BTN_DEBOUNCE_WORK)
 /**
- * @brief Called once the button has been debounced, sets button pressed state
+ * @brief Called once the button has been quiet for its debounce time, samples it
  * 
  * @param [in] work A k_work struct contained by a k_work_delayable inside a btn_gpio struct
  */
 static void _btn_debounce(struct k_work *_work) {
   struct k_work_delayable *dwork = CONTAINER_OF(_work, struct k_work_delayable, work);
   btn_gpio *btn = CONTAINER_OF(dwork, btn_gpio, work);
+  btn_id id = btn - _btns;
+
+  BTN_TRACE("btn_debounce", BIT(id), 0);
+  _btn_settle(id, gpio_pin_get_dt(&_btn_specs[id]) > 0);
+}
+#elif defined(CONFIG_BTN_DEBOUNCE_SHARED)
+/**
+ * @brief Invoked as an interrupt at the earliest quiet deadline, hands settled buttons to the settle work
+ * 
+ * @param [in] timer The shared debounce timer
+ */
+static void _btn_debounce_expiry(struct k_timer *timer) {
+  k_spinlock_key_t key = k_spin_lock(&_btn_debouncer.lock);
+  k_ticks_t now = k_uptime_ticks();
+  k_ticks_t next_deadline = INT64_MAX;
+  uint32_t bouncing = _btn_debouncer.bouncing_mask;
+
+  while (bouncing) {
+    uint32_t id = __builtin_ctz(bouncing);
+    bouncing &= bouncing - 1;
+    if (_btns[id].quiet_deadline <= now) {
+      _btn_debouncer.bouncing_mask &= ~BIT(id);
+      _btn_debouncer.settled_mask |= BIT(id);
+    } else {
+      next_deadline = MIN(next_deadline, _btns[id].quiet_deadline);
+    }
+  }
+
+  _btn_debouncer.armed_deadline = next_deadline;
+  if (INT64_MAX != next_deadline) {
+    k_timer_start(timer, K_TIMEOUT_ABS_TICKS(next_deadline), K_NO_WAIT);
+  }
+  uint32_t settled_mask = _btn_debouncer.settled_mask;
+  k_spin_unlock(&_btn_debouncer.lock, key);
 
-  if (gpio_pin_get_dt(&btn->spec)) {
-    btn->pressed = true;
+  BTN_TRACE("btn_debounce", settled_mask, 0);
+  if (settled_mask) {
+    k_work_submit(&_btn_debouncer.settle);
   }
 }
 
+/**
+ * @brief Samples every settled button, one read per port
+ * 
+ * @param [in] work The settle k_work struct of the shared debouncer
+ */
+static void _btn_debounce_settle(struct k_work *work) {
+  k_spinlock_key_t key = k_spin_lock(&_btn_debouncer.lock);
+  uint32_t settled = _btn_debouncer.settled_mask;
+  _btn_debouncer.settled_mask = 0;
+  k_spin_unlock(&_btn_debouncer.lock, key);
+
+  for (uint8_t i = 0; i < _btn_num_ports && settled; i++) {
+    uint32_t port_settled = settled & _btn_ports[i].btn_mask;
+    gpio_port_value_t value;
+
+    if (!port_settled || 0 > gpio_port_get(_btn_ports[i].port, &value)) {
+      continue;
+    }
+    settled &= ~port_settled;
+    while (port_settled) {
+      uint32_t id = __builtin_ctz(port_settled);
+      port_settled &= port_settled - 1;
+      _btn_settle(id, 0 != (value & BIT(_btn_specs[id].pin)));
+    }
+  }
+}
+#elif defined(CONFIG_BTN_DEBOUNCE_INTEGRATOR)
+/**
+ * @brief Runs one sample of every pin of a port through its two bit vertical counter.
+ *        Called with the debouncer lock held
+ * 
+ * @param [in] port The sampled port
+ * @param [in] sample Logical level of every pin, 1 while pressed
+ * 
+ * @return true while any button pin of the port differs from its debounced state
+ */
+static bool _btn_integrate(btn_port *port, gpio_port_value_t sample) {
+  gpio_port_value_t delta = (port->state ^ sample) & port->cb.pin_mask;
+
+  // Pins that agree with their state reset to the top, the others count down and toggle on wrap
+  port->count0 = ~(port->count0 & delta);
+  port->count1 = port->count0 ^ (port->count1 & delta);
+  gpio_port_value_t toggle = delta & port->count0 & port->count1;
+  port->state ^= toggle;
+
+  gpio_port_value_t pins = port->cb.pin_mask;
+  while (pins) {
+    uint32_t pin = __builtin_ctz(pins);
+    uint8_t id = port->pin_to_btn[pin];
+    pins &= pins - 1;
+    if (toggle & BIT(pin)) {
+      _btn_debouncer.settled_mask |= BIT(id);
+      if (port->state & BIT(pin)) {
+        _btn_debouncer.level_mask |= BIT(id);
+      } else {
+        _btn_debouncer.level_mask &= ~BIT(id);
+      }
+    }
+    if (!((delta & ~toggle) & BIT(pin))) {
+      // Agrees with its state again, the next edge starts a new burst
+      _btn_debouncer.bouncing_mask &= ~BIT(id);
+    }
+  }
+  return 0 != (delta & ~toggle);
+}
+
+/**
+ * @brief Invoked as an interrupt every sample period while buttons are moving, reads every port once
+ * 
+ * @param [in] timer The sampling timer
+ */
+static void _btn_debounce_sample(struct k_timer *timer) {
+  k_spinlock_key_t key = k_spin_lock(&_btn_debouncer.lock);
+  bool moving = false;
+
+  for (uint8_t i = 0; i < _btn_num_ports; i++) {
+    gpio_port_value_t raw;
+    if (0 > gpio_port_get_raw(_btn_ports[i].port, &raw)) {
+      moving = true;
+      continue;
+    }
+    moving |= _btn_integrate(&_btn_ports[i], raw ^ _btn_ports[i].active_low);
+  }
+
+  if (!moving) {
+    // Everything settled, the next edge restarts sampling
+    _btn_debouncer.sampling = false;
+    k_timer_stop(timer);
+  }
+  uint32_t settled_mask = _btn_debouncer.settled_mask;
+  k_spin_unlock(&_btn_debouncer.lock, key);
+
+  BTN_TRACE("btn_debounce", settled_mask, moving);
+  if (settled_mask) {
+    k_work_submit(&_btn_debouncer.settle);
+  }
+}
+
+/**
+ * @brief Reports every button the sampler changed the state of
+ * 
+ * @param [in] work The settle k_work struct of the debouncer
+ */
+static void _btn_debounce_settle(struct k_work *work) {
+  k_spinlock_key_t key = k_spin_lock(&_btn_debouncer.lock);
+  uint32_t settled = _btn_debouncer.settled_mask;
+  uint32_t levels = _btn_debouncer.level_mask;
+  _btn_debouncer.settled_mask = 0;
+  k_spin_unlock(&_btn_debouncer.lock, key);
+
+  while (settled) {
+    uint32_t id = __builtin_ctz(settled);
+    settled &= settled - 1;
+    _btn_settle(id, 0 != (levels & BIT(id)));
+  }
+}
+#endif
+
+/**
+ * @brief Takes the debounced level of a button, reports presses and releases and tracks
+ *        gestures. Runs on the system workqueue along with _btn_gesture so they never race
+ * 
+ * @param [in] id The debounced button
+ * @param [in] level The level it settled at, true while held down
+ */
+static void _btn_settle(btn_id id, bool level) {
+  btn_gpio *btn = &_btns[id];
+  int64_t now_ms = k_uptime_get();
+
+  if (level == btn->level) {
+    // Bounced back to where it was
+    return;
+  }
+  btn->level = level;
+  LATENCY_PROBE(LATENCY_BTN_DEBOUNCED, id);
+  BTN_TRACE("btn_settle", id, level);
+
+#if defined(CONFIG_BTN_LED_BINDING)
+  // Before anything is queued so the LED reacts without waiting on the application
+  _btn_apply_binding(btn, level);
+#endif
+
+  if (level) {
+    k_event_post(&_btn_pressed_events, BIT(id));
+    btn->long_pressed = false;
+    if (0 == btn->clicks || now_ms - btn->release_ms > CONFIG_BTN_MULTI_CLICK_MS) {
+      btn->clicks = 0;
+    }
+    btn->clicks = MIN(btn->clicks + 1, UINT8_MAX);
+    _btn_post(id, BTN_EVENT_PRESS, btn->edge_cycles, btn->clicks);
+    k_work_reschedule(&btn->gesture, K_MSEC(CONFIG_BTN_LONG_PRESS_MS));
+  } else {
+    btn->release_ms = now_ms;
+    _btn_post(id, BTN_EVENT_RELEASE, btn->edge_cycles, btn->clicks);
+    if (btn->long_pressed) {
+      btn->clicks = 0;
+      k_work_cancel_delayable(&btn->gesture);
+    } else if (btn->clicks > 1) {
+      k_work_reschedule(&btn->gesture, K_MSEC(CONFIG_BTN_MULTI_CLICK_MS));
+    } else {
+      // A single click has nothing to report, the next press restarts the count once the gap is over
+      k_work_cancel_delayable(&btn->gesture);
+    }
+  }
+}
+
+#if defined(CONFIG_BTN_LED_BINDING)
+/**
+ * @brief Applies the LED action bound to a button to its new level
+ * 
+ * @param [in] btn The button that changed
+ * @param [in] level The level it settled at, true while held down
+ */
+static void _btn_apply_binding(btn_gpio *btn, bool level) {
+  uint16_t binding = btn->binding;
+  led_id led = BTN_BINDING_LED(binding);
+  bool written = false;
+
+  switch (BTN_BINDING_ACTION(binding)) {
+    case BTN_LED_TOGGLE:
+      if (level) {
+        LED_toggle(led);
+        written = true;
+      }
+      break;
+    case BTN_LED_ON:
+      if (level) {
+        LED_set(led, LED_ON);
+        written = true;
+      }
+      break;
+    case BTN_LED_OFF:
+      if (level) {
+        LED_set(led, LED_OFF);
+        written = true;
+      }
+      break;
+    case BTN_LED_FOLLOW:
+      LED_set(led, level ? LED_ON : LED_OFF);
+      written = true;
+      break;
+    default:
+      break;
+  }
+
+  if (written) {
+    // Stamped here rather than in the LED driver so unrelated blink and fade writes never count
+    LATENCY_PROBE(LATENCY_LED_WRITTEN, btn - _btns);
+  }
+}
+#endif
+
+/**
+ * @brief Called when a hold reaches the long press time or a click sequence goes quiet
+ * 
+ * @param [in] work A k_work struct contained by the gesture k_work_delayable inside a btn_gpio struct
+ */
+static void _btn_gesture(struct k_work *_work) {
+  struct k_work_delayable *dwork = CONTAINER_OF(_work, struct k_work_delayable, work);
+  btn_gpio *btn = CONTAINER_OF(dwork, btn_gpio, gesture);
+  btn_id id = btn - _btns;
+
+  BTN_TRACE("btn_gesture", id, btn->clicks);
+  if (btn->level) {
+    btn->long_pressed = true;
+    _btn_post(id, BTN_EVENT_LONG_PRESS, k_cycle_get_32(), btn->clicks);
+  } else {
+    if (btn->clicks > 1) {
+      _btn_post(id, BTN_EVENT_MULTI_CLICK, k_cycle_get_32(), btn->clicks);
+    }
+    btn->clicks = 0;
+  }
+}
+
+/**
+ * @brief Queues a button event and hands it to the event callback, drops it if the queue is full
+ * 
+ * @param [in] btn The button the event is for
+ * @param [in] type What happened
+ * @param [in] cycles Hardware cycle count the event happened at
+ * @param [in] clicks Clicks in the multi-click sequence so far
+ */
+static void _btn_post(btn_id btn, btn_event_type type, uint32_t cycles, uint8_t clicks) {
+  btn_event event = {.cycles=cycles, .btn=btn, .type=type, .clicks=clicks};
+  if (!_btn_queueing) {
+    // Nobody reads the queue, the callback is the only consumer
+  } else if (0 == k_msgq_put(&_btn_event_queue, &event, K_NO_WAIT)) {
+    BTN_TRACE("btn_post", btn, type | (clicks << 8));
+  } else {
+    // The queue is full, only the callback sees the event
+    BTN_TRACE("btn_drop", btn, type | (clicks << 8));
+  }
+
+  btn_event_callback event_cb = _btn_event_cb;
+  if (NULL != event_cb) {
+    event_cb(&event);
+  }
+}
+
+#if defined(CONFIG_BTN_SETTINGS)
+/**
+ * @brief Reads the stored record of BTN_SETTINGS_KEY, records of another size or version are skipped
+ *
+ * @param [in] key the name below BTN_SETTINGS_KEY, NULL for the key itself
+ * @param [in] len the size of the stored record
+ * @param [in] read_cb reads the record from the backend
+ * @param [in] cb_arg passed to read_cb
+ * @param [out] param the btn_settings to fill
+ *
+ * @return Error code, < 0 on failures
+ */
+static int _btn_settings_read(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param) {
+  btn_settings stored;
+
+  if (NULL != key || sizeof(stored) != len) {
+    return 0;
+  }
+  if (sizeof(stored) != read_cb(cb_arg, &stored, sizeof(stored)) || BTN_SETTINGS_VERSION != stored.version) {
+    return 0;
+  }
+  memcpy(param, &stored, sizeof(stored));
+  return 0;
+}
+
+/**
+ * @brief Loads the stored record and applies every valid entry of it, called once by BTN_init.
+ *        Entries out of range keep their defaults
+ */
+static void _btn_settings_load(void) {
+  btn_settings stored = {0};
+
+  _btn_settings.version = BTN_SETTINGS_VERSION;
+  for (int i = 0; i < NUM_BTNS; i++) {
+    _btn_settings.debounce_ms[i] = CONFIG_BTN_DEBOUNCE_MS;
+  }
+
+  if (0 > settings_subsys_init() || 0 > settings_load_subtree_direct(BTN_SETTINGS_KEY, _btn_settings_read, &stored)) {
+    return;
+  }
+  if (BTN_SETTINGS_VERSION != stored.version) {
+    // Nothing stored yet
+    return;
+  }
+  _btn_settings_saved = stored;
+
+  for (int i = 0; i < NUM_BTNS; i++) {
+    uint16_t debounce_ms = stored.debounce_ms[i];
+    if (!IS_ENABLED(CONFIG_BTN_DEBOUNCE_INTEGRATOR) && debounce_ms > 0 && debounce_ms <= BTN_DEBOUNCE_MAX_MS) {
+      _btn_settings.debounce_ms[i] = debounce_ms;
+      _btns[i].debounce_ticks = k_ms_to_ticks_ceil32(debounce_ms);
+    }
+#if defined(CONFIG_BTN_LED_BINDING)
+    uint16_t binding = stored.bindings[i];
+    if (BTN_BINDING_ACTION(binding) < NUM_BTN_LED_ACTIONS && BTN_BINDING_LED(binding) < NUM_LEDS) {
+      _btn_settings.bindings[i] = binding;
+      _btns[i].binding = binding;
+    }
+#endif
+  }
+}
+
+/**
+ * @brief Schedules a save of the settings, every change until it runs goes into the same write
+ */
+static void _btn_settings_changed(void) {
+  // Schedule rather than reschedule so a steady stream of changes can't hold the save off
+  k_work_schedule(&_btn_settings_work, K_MSEC(CONFIG_BTN_SETTINGS_SAVE_DELAY_MS));
+}
+
+/**
+ * @brief Writes the settings as one record from the system workqueue, skipped if nothing changed since the last write
+ *
+ * @param [in] work Unused, the file's only settings work item
+ */
+static void _btn_settings_save(struct k_work *work) {
+  btn_settings settings;
+
+  k_spinlock_key_t key = k_spin_lock(&_btn_settings_lock);
+  settings = _btn_settings;
+  k_spin_unlock(&_btn_settings_lock, key);
+
+  if (0 == memcmp(&settings, &_btn_settings_saved, sizeof(settings))) {
+    return;
+  }
+  if (0 == settings_save_one(BTN_SETTINGS_KEY, &settings, sizeof(settings))) {
+    _btn_settings_saved = settings;
+  }
+}
+#endif
+
 /* ----------------------------------------------------------------------------
                               Public Functions
 ---------------------------------------------------------------------------- */
@@ -117,8 +728,25 @@ static void _btn_debounce(struct k_work *_work) {
  * @return Error code, < 0 on failures
  */
 int BTN_init() {
+#if defined(CONFIG_BTN_DEBOUNCE_SHARED)
+  k_timer_init(&_btn_debouncer.timer, _btn_debounce_expiry, NULL);
+  k_work_init(&_btn_debouncer.settle, _btn_debounce_settle);
+#elif defined(CONFIG_BTN_DEBOUNCE_INTEGRATOR)
+  k_timer_init(&_btn_debouncer.timer, _btn_debounce_sample, NULL);
+  k_work_init(&_btn_debouncer.settle, _btn_debounce_settle);
+#endif
   for (uint8_t i = 0; i < NUM_BTNS; i++) {
-    int rv = _btn_config(_btns[i]);
+    int rv = _btn_config(i);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+#if defined(CONFIG_BTN_SETTINGS)
+  // Before the callbacks are added so the first edge already uses the stored debounce times
+  _btn_settings_load();
+#endif
+  for (uint8_t i = 0; i < _btn_num_ports; i++) {
+    int rv = gpio_add_callback(_btn_ports[i].port, &_btn_ports[i].cb);
     if (rv < 0) {
       return rv;
     }
@@ -126,6 +754,133 @@ int BTN_init() {
   return 0;
 }
 
+/**
+ * @brief Sets how long the given button must be quiet after an edge before its level is taken
+ * 
+ * @param [in] btn Which button to set
+ * @param [in] debounce_ms The debounce time, 1 - 60000ms
+ * 
+ * @return Error code, -ENOTSUP with the integrating debounce
+ */
+int BTN_set_debounce_ms(btn_id btn, uint32_t debounce_ms) {
+  if (IS_INVALID_BTN(btn)) {
+    return -EINVAL;
+  } else if (0 == debounce_ms || debounce_ms > BTN_DEBOUNCE_MAX_MS) {
+    return -EINVAL;
+  } else if (IS_ENABLED(CONFIG_BTN_DEBOUNCE_INTEGRATOR)) {
+    // Debounced by sample count rather than time
+    return -ENOTSUP;
+  }
+
+  // A single word store, the ISR picks it up from the next edge on
+  _btns[btn].debounce_ticks = k_ms_to_ticks_ceil32(debounce_ms);
+
+#if defined(CONFIG_BTN_SETTINGS)
+  k_spinlock_key_t key = k_spin_lock(&_btn_settings_lock);
+  _btn_settings.debounce_ms[btn] = debounce_ms;
+  k_spin_unlock(&_btn_settings_lock, key);
+  _btn_settings_changed();
+#endif
+  return 0;
+}
+
+#if defined(CONFIG_BTN_LED_BINDING)
+/**
+ * @brief Binds an LED action to a button, applied by the debounce work the moment the button settles.
+ *        Events and the pressed flag are still reported as usual
+ * 
+ * @param [in] btn Which button to bind
+ * @param [in] led The LED the action applies to
+ * @param [in] action What the button does to the LED, BTN_LED_NONE removes the binding
+ * 
+ * @return Error code, < 0 on failures
+ */
+int BTN_bind_led_action(btn_id btn, led_id led, btn_led_action action) {
+  if (IS_INVALID_BTN(btn)) {
+    return -EINVAL;
+  } else if (action >= NUM_BTN_LED_ACTIONS || action < 0) {
+    return -EINVAL;
+  } else if (BTN_LED_NONE != action && (led >= NUM_LEDS || led < 0)) {
+    return -EINVAL;
+  }
+
+  _btns[btn].binding = BTN_BINDING((BTN_LED_NONE == action) ? 0 : led, action);
+
+#if defined(CONFIG_BTN_SETTINGS)
+  k_spinlock_key_t key = k_spin_lock(&_btn_settings_lock);
+  _btn_settings.bindings[btn] = _btns[btn].binding;
+  k_spin_unlock(&_btn_settings_lock, key);
+  _btn_settings_changed();
+#endif
+  return 0;
+}
+#endif
+
+/**
+ * @brief Sets a function called with every button event as it happens, from the system workqueue.
+ *        The events are queued for BTN_get_event as well
+ * 
+ * @param [in] callback Called with each event, NULL to stop the calls
+ */
+void BTN_set_event_callback(btn_event_callback callback) {
+  _btn_event_cb = callback;
+}
+
+/**
+ * @brief Turns queueing of events for BTN_get_event on or off, the callback sees every event either way.
+ *        Consumers that only use the callback turn it off so the unread queue never fills and drops
+ * 
+ * @param [in] enable true to queue events, false to stop and drop whatever is queued
+ */
+void BTN_set_event_queueing(bool enable) {
+  _btn_queueing = enable;
+  if (!enable) {
+    k_msgq_purge(&_btn_event_queue);
+  }
+}
+
+/**
+ * @brief Takes the oldest button event from the queue
+ * 
+ * @param [out] event Filled with the event
+ * @param [in] timeout How long to wait for an event, K_FOREVER blocks until one arrives
+ * 
+ * @return Error code, -EAGAIN if no event arrived in time
+ */
+int BTN_get_event(btn_event *event, k_timeout_t timeout) {
+  if (NULL == event) {
+    return -EINVAL;
+  }
+  int rv = k_msgq_get(&_btn_event_queue, event, timeout);
+  if (0 == rv) {
+    LATENCY_PROBE(LATENCY_BTN_DEQUEUED, event->btn);
+    BTN_TRACE("btn_dequeue", event->btn, event->type);
+  }
+  return (-ENOMSG == rv) ? -EAGAIN : rv;
+}
+
+/**
+ * @brief Sleeps until one of the given buttons has been pressed, clears their pressed flags
+ * 
+ * @param [in] btn_mask Bitmask of the buttons to wait for, BIT(BTNx)
+ * @param [in] timeout How long to wait, K_FOREVER sleeps until a press arrives
+ * 
+ * @return Bitmask of the buttons in btn_mask that were pressed, 0 if none were in time
+ */
+uint32_t BTN_wait(uint32_t btn_mask, k_timeout_t timeout) {
+  btn_mask &= BTN_ALL_MASK;
+  if (0 == btn_mask) {
+    return 0;
+  }
+
+  // Returns right away if a press is already pending
+  if (0 == k_event_wait(&_btn_pressed_events, btn_mask, false, timeout)) {
+    return 0;
+  }
+  // Clearing hands back what was set, so a press landing between the two calls isn't lost
+  return k_event_clear(&_btn_pressed_events, btn_mask);
+}
+
 /**
  * @brief Checks if the given button is currently being pressed
  * 
@@ -136,7 +891,7 @@ int BTN_init() {
 bool BTN_is_pressed(btn_id btn) {
   if (IS_INVALID_BTN(btn)) {
     return false;
-  } else if (0 < gpio_pin_get_dt(&_btns[btn]->spec)) {
+  } else if (0 < gpio_pin_get_dt(&_btn_specs[btn])) {
     return true;
   } else {
     return false;
@@ -155,9 +910,7 @@ bool BTN_check_clear_pressed(btn_id btn) {
   if (IS_INVALID_BTN(btn)) {
     return false;
   } else {
-    bool was_pressed = _btns[btn]->pressed;
-    _btns[btn]->pressed = false;
-    return was_pressed;
+    return 0 != k_event_clear(&_btn_pressed_events, BIT(btn));
   }
 }
 
@@ -172,7 +925,7 @@ bool BTN_check_pressed(btn_id btn) {
   if (IS_INVALID_BTN(btn)) {
     return false;
   } else {
-    return _btns[btn]->pressed;
+    return 0 != k_event_test(&_btn_pressed_events, BIT(btn));
   }
 }
 
@@ -185,7 +938,7 @@ void BTN_clear_pressed(btn_id btn) {
   if (IS_INVALID_BTN(btn)) {
     return;
   } else {
-    _btns[btn]->pressed = false;
+    k_event_clear(&_btn_pressed_events, BIT(btn));
     return;
   }
 }
@@ -0,0 +1,35 @@
+/*
+Header to define the thread stack and CPU usage report
+*/
+
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/kernel.h>
+
+/* ----------------------------------------------------------------------------
+                                    TYPES
+---------------------------------------------------------------------------- */
+typedef struct diag_thread_t {
+  k_tid_t thread;
+  const char *name; // "?" without CONFIG_THREAD_NAME or a name
+  size_t stack_size; // Bytes
+  size_t stack_used; // Deepest use since the thread's creation
+  size_t stack_suggested; // stack_used plus CONFIG_DIAG_STACK_MARGIN_PCT, 8 byte aligned
+  uint32_t cpu_ppm; // Share of all CPU cycles since boot, 0 without CONFIG_SCHED_THREAD_USAGE
+  uint32_t cpu_recent_ppm; // Share since the previous report
+} diag_thread;
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+int DIAG_init();
+
+int DIAG_get_thread(k_tid_t thread, diag_thread *info);
+
+void DIAG_report();
+
+#endif
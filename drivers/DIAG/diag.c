@@ -0,0 +1,206 @@
+/*
+Thread stack and CPU usage report. Stacks are painted when threads are created so the
+deepest use of each one can be read back, CPU shares come from the scheduler's per thread
+runtime stats.
+*/
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "DIAG.h"
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define DIAG_MAX_THREADS          16 // Threads beyond this are left out of the report
+#define DIAG_STACK_ALIGN          8 // Suggested sizes keep the AAPCS stack alignment
+#define DIAG_PPM                  1000000ULL
+
+/* ----------------------------------------------------------------------------
+                                    Types
+---------------------------------------------------------------------------- */
+typedef struct diag_threads_t {
+  k_tid_t threads[DIAG_MAX_THREADS];
+  size_t count;
+} diag_threads;
+
+typedef struct diag_sample_t {
+  k_tid_t thread;
+  uint64_t cycles; // Execution cycles of the thread at the previous report
+} diag_sample;
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static void _diag_collect(const struct k_thread *thread, void *user_data);
+
+static uint32_t _diag_ppm(uint64_t part, uint64_t whole);
+
+static void _diag_fill(k_tid_t thread, diag_thread *info);
+
+static void _diag_report_work(struct k_work *work);
+
+#if defined(CONFIG_SHELL)
+static int _diag_cmd_report(const struct shell *sh, size_t argc, char **argv);
+#endif
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+#if defined(CONFIG_SCHED_THREAD_USAGE)
+static diag_sample _diag_samples[DIAG_MAX_THREADS];
+static uint64_t _diag_total_cycles; // Cycles of every thread, idle included, at the previous report
+#endif
+
+static K_WORK_DELAYABLE_DEFINE(_diag_work, _diag_report_work);
+
+#if defined(CONFIG_SHELL)
+SHELL_CMD_REGISTER(diag, NULL, "Print stack use, suggested stack sizes and CPU share of every thread", _diag_cmd_report);
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Adds a thread to the list being reported, runs without the thread list lock
+ */
+static void _diag_collect(const struct k_thread *thread, void *user_data) {
+  diag_threads *threads = user_data;
+
+  if (threads->count < DIAG_MAX_THREADS) {
+    threads->threads[threads->count++] = (k_tid_t)thread;
+  }
+}
+
+static uint32_t _diag_ppm(uint64_t part, uint64_t whole) {
+  return whole ? (uint32_t)((part * DIAG_PPM) / whole) : 0;
+}
+
+/**
+ * @brief Reads the stack use and CPU share of a thread, the recent share is against the last report
+ *
+ * @param [in] thread the thread to read
+ * @param [out] info filled with the thread's usage
+ */
+static void _diag_fill(k_tid_t thread, diag_thread *info) {
+  size_t unused = 0;
+
+  memset(info, 0, sizeof(*info));
+  info->thread = thread;
+  info->name = k_thread_name_get(thread);
+  if (NULL == info->name || '\0' == info->name[0]) {
+    info->name = "?";
+  }
+
+  info->stack_size = thread->stack_info.size;
+  if (0 == k_thread_stack_space_get(thread, &unused)) {
+    info->stack_used = info->stack_size - unused;
+  }
+  info->stack_suggested = ROUND_UP((info->stack_used * (100 + CONFIG_DIAG_STACK_MARGIN_PCT)) / 100, DIAG_STACK_ALIGN);
+
+#if defined(CONFIG_SCHED_THREAD_USAGE)
+  k_thread_runtime_stats_t stats;
+  k_thread_runtime_stats_t all;
+
+  if (0 == k_thread_runtime_stats_get(thread, &stats) && 0 == k_thread_runtime_stats_all_get(&all)) {
+    info->cpu_ppm = _diag_ppm(stats.execution_cycles, all.execution_cycles);
+
+    uint64_t previous = 0;
+    for (int i = 0; i < DIAG_MAX_THREADS; i++) {
+      if (thread == _diag_samples[i].thread) {
+        previous = _diag_samples[i].cycles;
+        break;
+      }
+    }
+    info->cpu_recent_ppm = _diag_ppm(stats.execution_cycles - previous, all.execution_cycles - _diag_total_cycles);
+  }
+#endif
+}
+
+static void _diag_report_work(struct k_work *work) {
+  DIAG_report();
+  k_work_schedule(k_work_delayable_from_work(work), K_MSEC(CONFIG_DIAG_REPORT_INTERVAL_MS));
+}
+
+#if defined(CONFIG_SHELL)
+static int _diag_cmd_report(const struct shell *sh, size_t argc, char **argv) {
+  DIAG_report();
+  return 0;
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Starts the periodic report when CONFIG_DIAG_REPORT_INTERVAL_MS is set
+ *
+ * @return Error code, < 0 on failures
+ */
+int DIAG_init() {
+  if (CONFIG_DIAG_REPORT_INTERVAL_MS > 0) {
+    k_work_schedule(&_diag_work, K_MSEC(CONFIG_DIAG_REPORT_INTERVAL_MS));
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads the usage of one thread
+ *
+ * @param [in] thread the thread to read
+ * @param [out] info filled with the thread's usage
+ *
+ * @return Error code, < 0 on failures
+ */
+int DIAG_get_thread(k_tid_t thread, diag_thread *info) {
+  if (NULL == thread || NULL == info) {
+    return -EINVAL;
+  }
+  _diag_fill(thread, info);
+  return 0;
+}
+
+/**
+ * @brief Prints the stack use, suggested stack size and CPU share of every thread through printk.
+ *        A thread whose headroom is below the margin is flagged LOW
+ */
+void DIAG_report() {
+  diag_threads threads = {0};
+
+  // Unlocked so the scheduler isn't held off, threads created meanwhile show in the next report
+  k_thread_foreach_unlocked(_diag_collect, &threads);
+
+  printk("%-16s %6s %6s %9s %8s %8s\n", "thread", "stack", "used", "suggested", "cpu%", "recent%");
+  for (size_t i = 0; i < threads.count; i++) {
+    diag_thread info;
+
+    _diag_fill(threads.threads[i], &info);
+    printk("%-16s %6u %6u %9u %5u.%02u %5u.%02u%s\n", info.name,
+      (unsigned int)info.stack_size, (unsigned int)info.stack_used, (unsigned int)info.stack_suggested,
+      info.cpu_ppm / 10000, (info.cpu_ppm / 100) % 100,
+      info.cpu_recent_ppm / 10000, (info.cpu_recent_ppm / 100) % 100,
+      (info.stack_suggested > info.stack_size) ? " LOW" : "");
+  }
+
+#if defined(CONFIG_SCHED_THREAD_USAGE)
+  // The next report's recent shares start from here
+  k_thread_runtime_stats_t all;
+  k_thread_runtime_stats_all_get(&all);
+  _diag_total_cycles = all.execution_cycles;
+
+  memset(_diag_samples, 0, sizeof(_diag_samples));
+  for (size_t i = 0; i < threads.count; i++) {
+    k_thread_runtime_stats_t stats;
+    if (0 == k_thread_runtime_stats_get(threads.threads[i], &stats)) {
+      _diag_samples[i] = (diag_sample){.thread=threads.threads[i], .cycles=stats.execution_cycles};
+    }
+  }
+#endif
+}
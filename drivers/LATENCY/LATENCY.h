@@ -0,0 +1,75 @@
+/*
+Header to define the button to LED latency probes
+*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/toolchain.h>
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define LATENCY_KEY_LAST          0xFF // LATENCY_LED_WRITTEN only, the write answers the last button to settle
+
+/* ----------------------------------------------------------------------------
+                                    TYPES
+---------------------------------------------------------------------------- */
+typedef enum latency_probe_t {
+  LATENCY_BTN_EDGE = 0, // First edge of a press or release, the origin of the later probes
+  LATENCY_BTN_DEBOUNCED, // The debounce settled the button
+  LATENCY_BTN_DEQUEUED, // The consumer took the button's event
+  LATENCY_LED_WRITTEN, // The first LED write made in answer to a settled button, recorded by the writer
+  NUM_LATENCY_PROBES,
+} latency_probe;
+
+typedef struct latency_stats_t {
+  uint32_t count;
+  uint32_t min; // All values are in CPU cycles from the edge
+  uint32_t mean;
+  uint32_t max;
+  uint32_t p50; // Percentiles are bucket upper bounds
+  uint32_t p90;
+  uint32_t p99;
+} latency_stats;
+
+/* ----------------------------------------------------------------------------
+                                  Macro Helpers
+---------------------------------------------------------------------------- */
+#if defined(CONFIG_LATENCY)
+// A single load and branch while recording is stopped
+#define LATENCY_PROBE(probe, key) do { \
+    if (unlikely(LATENCY_recording)) { \
+      LATENCY_record((probe), (key)); \
+    } \
+  } while (0)
+#else
+#define LATENCY_PROBE(probe, key) do { } while (0)
+#endif
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+#if defined(CONFIG_LATENCY)
+extern volatile bool LATENCY_recording;
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+int LATENCY_init();
+
+void LATENCY_record(latency_probe probe, uint8_t key);
+
+void LATENCY_enable(bool enable);
+
+void LATENCY_reset();
+
+int LATENCY_get_stats(latency_probe probe, latency_stats *stats);
+
+void LATENCY_dump();
+
+#endif
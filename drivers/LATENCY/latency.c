@@ -0,0 +1,300 @@
+/*
+Button to LED latency probes. Every button edge is stamped with the DWT cycle counter and
+the cycles from it to the end of its debounce, the dequeue of its event and the first LED
+write after it are binned into a histogram per probe.
+*/
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+#include <cmsis_core.h>
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "LATENCY.h"
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define LATENCY_NUM_BUCKETS       32 // Bucket n holds deltas below 2^n cycles
+#define LATENCY_NUM_KEYS          16 // Keys are button ids, btn_id stops at BTN15
+
+/* ----------------------------------------------------------------------------
+                                    Types
+---------------------------------------------------------------------------- */
+typedef struct latency_histogram_t {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+  uint32_t buckets[LATENCY_NUM_BUCKETS];
+} latency_histogram;
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static uint32_t _latency_now(void);
+
+static void _latency_add(latency_probe probe, uint32_t cycles);
+
+static uint32_t _latency_percentile(const latency_histogram *histogram, uint32_t percent);
+
+#if defined(CONFIG_SHELL)
+static int _latency_cmd_dump(const struct shell *sh, size_t argc, char **argv);
+
+static int _latency_cmd_reset(const struct shell *sh, size_t argc, char **argv);
+
+static int _latency_cmd_enable(const struct shell *sh, size_t argc, char **argv);
+
+static int _latency_cmd_disable(const struct shell *sh, size_t argc, char **argv);
+#endif
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+volatile bool LATENCY_recording = false;
+
+static struct k_spinlock _latency_lock;
+
+static uint32_t _latency_origin[LATENCY_NUM_KEYS]; // Cycle count of the last edge of each key
+static uint32_t _latency_pending[NUM_LATENCY_PROBES]; // Keys each probe still has to see since their edge
+static uint8_t _latency_led_key; // Key of the last settled button, the LED probe measures from its edge
+
+static latency_histogram _latency_histograms[NUM_LATENCY_PROBES];
+
+static const char *const _latency_names[NUM_LATENCY_PROBES] = {
+  [LATENCY_BTN_EDGE] = "edge",
+  [LATENCY_BTN_DEBOUNCED] = "edge -> debounced",
+  [LATENCY_BTN_DEQUEUED] = "edge -> dequeued",
+  [LATENCY_LED_WRITTEN] = "edge -> LED written",
+};
+
+#if defined(CONFIG_SHELL)
+SHELL_STATIC_SUBCMD_SET_CREATE(_latency_cmds,
+  SHELL_CMD(dump, NULL, "Print every latency histogram", _latency_cmd_dump),
+  SHELL_CMD(reset, NULL, "Clear every latency histogram", _latency_cmd_reset),
+  SHELL_CMD(enable, NULL, "Start recording", _latency_cmd_enable),
+  SHELL_CMD(disable, NULL, "Stop recording", _latency_cmd_disable),
+  SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(latency, &_latency_cmds, "Button to LED latency probes", NULL);
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Reads the DWT cycle counter, counts CPU cycles even while the system timer is idle
+ */
+static uint32_t _latency_now(void) {
+  return DWT->CYCCNT;
+}
+
+/**
+ * @brief Adds a delta to the given probe's histogram, called with _latency_lock held
+ *
+ * @param [in] probe the probe the delta was measured at
+ * @param [in] cycles cycles from the origin edge to the probe
+ */
+static void _latency_add(latency_probe probe, uint32_t cycles) {
+  latency_histogram *histogram = &_latency_histograms[probe];
+  uint32_t bucket = cycles ? MIN(32 - __builtin_clz(cycles), LATENCY_NUM_BUCKETS - 1) : 0;
+
+  histogram->min = (0 == histogram->count) ? cycles : MIN(histogram->min, cycles);
+  histogram->max = MAX(histogram->max, cycles);
+  histogram->sum += cycles;
+  histogram->count++;
+  histogram->buckets[bucket]++;
+}
+
+/**
+ * @brief Estimates a percentile from the histogram buckets
+ *
+ * @param [in] histogram the histogram to read
+ * @param [in] percent the percentile, 0 - 100
+ *
+ * @return Upper bound in cycles of the bucket the percentile falls in, never above the max
+ */
+static uint32_t _latency_percentile(const latency_histogram *histogram, uint32_t percent) {
+  uint64_t target = ((uint64_t)histogram->count * percent + 99) / 100;
+  uint64_t seen = 0;
+
+  for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= target) {
+      return MIN((uint32_t)BIT64_MASK(i), histogram->max);
+    }
+  }
+  return histogram->max;
+}
+
+#if defined(CONFIG_SHELL)
+static int _latency_cmd_dump(const struct shell *sh, size_t argc, char **argv) {
+  LATENCY_dump();
+  return 0;
+}
+
+static int _latency_cmd_reset(const struct shell *sh, size_t argc, char **argv) {
+  LATENCY_reset();
+  return 0;
+}
+
+static int _latency_cmd_enable(const struct shell *sh, size_t argc, char **argv) {
+  LATENCY_enable(true);
+  return 0;
+}
+
+static int _latency_cmd_disable(const struct shell *sh, size_t argc, char **argv) {
+  LATENCY_enable(false);
+  return 0;
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Starts the DWT cycle counter, recording starts with CONFIG_LATENCY_START_ENABLED
+ *
+ * @return Error code, < 0 on failures
+ */
+int LATENCY_init() {
+#if defined(DCB)
+  DCB->DEMCR |= DCB_DEMCR_TRCENA_Msk;
+#else
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+#endif
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+  LATENCY_reset();
+  LATENCY_enable(IS_ENABLED(CONFIG_LATENCY_START_ENABLED));
+  return 0;
+}
+
+/**
+ * @brief Records a probe, use LATENCY_PROBE so nothing is called while recording is stopped.
+ *        Safe to call from interrupts
+ *
+ * @param [in] probe the probe that was reached
+ * @param [in] key the button the probe is for, LATENCY_LED_WRITTEN also takes LATENCY_KEY_LAST
+ *                 when the writer doesn't know which button it answers
+ */
+void LATENCY_record(latency_probe probe, uint8_t key) {
+  uint32_t now = _latency_now();
+
+  if (probe >= NUM_LATENCY_PROBES) {
+    return;
+  } else if (key >= LATENCY_NUM_KEYS && !(LATENCY_LED_WRITTEN == probe && LATENCY_KEY_LAST == key)) {
+    return;
+  }
+
+  k_spinlock_key_t lock = k_spin_lock(&_latency_lock);
+
+  switch (probe) {
+    case LATENCY_BTN_EDGE:
+      _latency_origin[key] = now;
+      _latency_pending[LATENCY_BTN_DEBOUNCED] |= BIT(key);
+      _latency_pending[LATENCY_BTN_DEQUEUED] |= BIT(key);
+      break;
+    case LATENCY_BTN_DEBOUNCED:
+      if (_latency_pending[probe] & BIT(key)) {
+        _latency_add(probe, now - _latency_origin[key]);
+        _latency_led_key = key;
+        _latency_pending[LATENCY_LED_WRITTEN] = BIT(key);
+      }
+      break;
+    case LATENCY_LED_WRITTEN:
+      if (LATENCY_KEY_LAST == key) {
+        // A write from outside the button path, it answers the latest press to settle
+        key = _latency_led_key;
+      }
+      // fall through
+    default:
+      if (_latency_pending[probe] & BIT(key)) {
+        _latency_add(probe, now - _latency_origin[key]);
+      }
+      break;
+  }
+  // Only the first time each probe is reached after an edge counts
+  _latency_pending[probe] &= ~BIT(key);
+
+  k_spin_unlock(&_latency_lock, lock);
+}
+
+/**
+ * @brief Starts or stops recording, probes are a load and a branch while stopped
+ *
+ * @param [in] enable true to record
+ */
+void LATENCY_enable(bool enable) {
+  LATENCY_recording = enable;
+}
+
+/**
+ * @brief Clears every histogram and forgets every edge in flight
+ */
+void LATENCY_reset() {
+  k_spinlock_key_t key = k_spin_lock(&_latency_lock);
+  memset(_latency_histograms, 0, sizeof(_latency_histograms));
+  memset(_latency_pending, 0, sizeof(_latency_pending));
+  k_spin_unlock(&_latency_lock, key);
+}
+
+/**
+ * @brief Summarises the histogram of a probe
+ *
+ * @param [in] probe the probe to summarise, LATENCY_BTN_EDGE has no histogram
+ * @param [out] stats filled with the summary, all zero without samples
+ *
+ * @return Error code, < 0 on failures
+ */
+int LATENCY_get_stats(latency_probe probe, latency_stats *stats) {
+  latency_histogram histogram;
+
+  if (NULL == stats || probe <= LATENCY_BTN_EDGE || probe >= NUM_LATENCY_PROBES) {
+    return -EINVAL;
+  }
+
+  // Work from a copy so the probes aren't held off
+  k_spinlock_key_t key = k_spin_lock(&_latency_lock);
+  histogram = _latency_histograms[probe];
+  k_spin_unlock(&_latency_lock, key);
+
+  memset(stats, 0, sizeof(*stats));
+  if (0 == histogram.count) {
+    return 0;
+  }
+  stats->count = histogram.count;
+  stats->min = histogram.min;
+  stats->mean = (uint32_t)(histogram.sum / histogram.count);
+  stats->max = histogram.max;
+  stats->p50 = _latency_percentile(&histogram, 50);
+  stats->p90 = _latency_percentile(&histogram, 90);
+  stats->p99 = _latency_percentile(&histogram, 99);
+  return 0;
+}
+
+/**
+ * @brief Prints min, mean, max and percentiles of every probe through printk,
+ *        which follows the console to UART or RTT
+ */
+void LATENCY_dump() {
+  uint32_t cycles_per_us = SystemCoreClock / USEC_PER_SEC;
+
+  for (int i = LATENCY_BTN_DEBOUNCED; i < NUM_LATENCY_PROBES; i++) {
+    latency_stats stats;
+
+    LATENCY_get_stats(i, &stats);
+    if (0 == stats.count) {
+      printk("%-20s no samples\n", _latency_names[i]);
+      continue;
+    }
+    printk("%-20s n=%u min=%u mean=%u max=%u p50<=%u p90<=%u p99<=%u cycles (%u cycles/us)\n",
+      _latency_names[i], stats.count, stats.min, stats.mean, stats.max, stats.p50, stats.p90, stats.p99, cycles_per_us);
+  }
+}
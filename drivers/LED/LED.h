@@ -6,18 +6,37 @@ Header to define led interface
 #define LED_H
 
 #include "stdint.h"
+#include <zephyr/devicetree.h>
+#include <zephyr/sys/util.h>
 
 /* ----------------------------------------------------------------------------
                                     TYPES
 ---------------------------------------------------------------------------- */
+#define LED_DT_NODE   DT_COMPAT_GET_ANY_STATUS_OKAY(pwm_leds)
+#define NUM_LEDS      DT_CHILD_NUM_STATUS_OKAY(LED_DT_NODE) // One LED per okay pwm-leds child
+
+// LEDx is the x-th okay child of the pwm-leds node, only ids below NUM_LEDS exist on a board
 typedef enum led_id_t {
   LED0 = 0,
   LED1,
   LED2,
   LED3,
-  NUM_LEDS,
+  LED4,
+  LED5,
+  LED6,
+  LED7,
+  LED8,
+  LED9,
+  LED10,
+  LED11,
+  LED12,
+  LED13,
+  LED14,
+  LED15,
 } led_id;
 
+#define LED_ALL_MASK ((uint32_t)((1ULL << NUM_LEDS) - 1)) // Bitmask of every LED instance
+
 typedef enum led_state_t {
   LED_OFF = 0,
   LED_ON,
@@ -31,6 +50,40 @@ typedef enum led_frequency_t {
   LED_16HZ = 16,
 } led_frequency;
 
+typedef enum led_fade_curve_t {
+  LED_FADE_LINEAR = 0,
+  LED_FADE_GAMMA, // Perceptually even steps, fade ends are perceived brightness
+} led_fade_curve;
+
+typedef void (*led_done_callback)(led_id led); // Told when a fade or pattern of the LED has ended
+
+#if defined(CONFIG_LED_PATTERN)
+// One keyframe, the LEDs in mask are set to their duty cycles in one update and held for hold_ms
+typedef struct led_frame_t {
+  uint16_t hold_ms; // 0 applies the next frame in the same update
+  uint16_t mask; // LEDs the frame sets, the others keep their duty cycle
+  uint8_t duty_cycles[NUM_LEDS]; // Indexed by led_id, 0 - 100
+} led_frame;
+
+typedef struct led_pattern_t {
+  const led_frame *frames;
+  uint16_t num_frames;
+  uint16_t repeat; // Times the frames are played, 0 loops until halted
+} led_pattern;
+
+// LED_FRAME(hold_ms, mask, duty of LED0, duty of LED1, ...)
+#define LED_FRAME(hold, led_mask, ...) {.hold_ms=(hold), .mask=(led_mask), .duty_cycles={__VA_ARGS__}}
+
+// Defines a const pattern and its frames, both stay in flash
+#define LED_PATTERN_DEFINE(name, plays, ...) \
+  static const led_frame name##_frames[] = {__VA_ARGS__}; \
+  static const led_pattern name = {.frames=name##_frames, .num_frames=ARRAY_SIZE(name##_frames), .repeat=(plays)}
+#endif
+
+#if defined(CONFIG_LED_LAYERS)
+typedef uint8_t led_layer; // 0 - CONFIG_LED_NUM_LAYERS - 1, the highest layer with a request drives the LED
+#endif
+
 /* ----------------------------------------------------------------------------
                               Public Functions
 ---------------------------------------------------------------------------- */
@@ -42,6 +95,58 @@ int LED_set(led_id led, led_state new_state);
 
 int LED_pwm(led_id led, uint8_t duty_cycle);
 
+int LED_pwm_pulse_ns(led_id led, uint32_t pulse_ns);
+
+int LED_pwm_multi(uint32_t led_mask, const uint8_t duty_cycles[NUM_LEDS]);
+
+int LED_set_mask(uint32_t led_mask, uint32_t on_mask);
+
+int LED_stage(led_id led, uint8_t duty_cycle);
+
+int LED_commit();
+
+#if defined(CONFIG_LED_SETTINGS)
+int LED_set_max_duty_cycle(led_id led, uint8_t max_duty_cycle);
+
+int LED_get_max_duty_cycle(led_id led);
+#endif
+
+#if defined(CONFIG_LED_BLINK)
 void LED_blink(led_id led, led_frequency frequency);
 
+int LED_blink_ms(led_id led, uint32_t on_ms, uint32_t off_ms, uint32_t phase_ms);
+
+int LED_fade(led_id led, uint8_t from, uint8_t to, uint32_t duration_ms, led_fade_curve curve);
+
+int LED_breathe(led_id led, uint8_t low, uint8_t high, uint32_t period_ms);
+
+void LED_set_done_callback(led_done_callback callback);
+#endif
+
+#if defined(CONFIG_LED_LAYERS)
+int LED_layer_set(led_layer layer, led_id led, uint8_t duty_cycle);
+
+int LED_layer_blink_ms(led_layer layer, led_id led, uint32_t on_ms, uint32_t off_ms);
+
+int LED_layer_release(led_layer layer, uint32_t led_mask);
+#endif
+
+#if defined(CONFIG_LED_ASYNC)
+int LED_toggle_async(led_id led);
+
+int LED_set_async(led_id led, led_state new_state);
+
+int LED_pwm_async(led_id led, uint8_t duty_cycle);
+
+int LED_set_mask_async(uint32_t led_mask, uint32_t on_mask);
+
+int LED_blink_async(led_id led, led_frequency frequency);
+#endif
+
+#if defined(CONFIG_LED_PATTERN)
+int LED_pattern_play(const led_pattern *pattern);
+
+void LED_pattern_stop();
+#endif
+
 #endif
\ No newline at end of file
@@ -2,242 +2,2287 @@
 Header to define led module logic
 */
 
+#include <string.h>
+
 #include <zephyr/kernel.h>
 #include <zephyr/drivers/pwm.h>
 #include <inttypes.h>
 
+#if defined(CONFIG_LED_PM)
+#include <zephyr/pm/device_runtime.h>
+#endif
+
+#if defined(CONFIG_LED_TRACE)
+#include <zephyr/tracing/tracing.h>
+#endif
+
+#if defined(CONFIG_LED_SETTINGS)
+#include <zephyr/settings/settings.h>
+#endif
+
 #include "LED.h"
 
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+#include "led_pwm_seq.h"
+#endif
+
 /* ----------------------------------------------------------------------------
                                     Constants
 ---------------------------------------------------------------------------- */
-#define LED_BLINK_STACK_SIZE      384
-#define LED_BLINK_PRIORITY        1
-#define LED_COUNTER_UNIT          100 // Units per ms (1 unit == 10us)
-#define LED_COUNTER_HALF_PERIOD   500 * LED_COUNTER_UNIT // Units per half second (1 second / 2 == 500ms)
+#define LED_HALF_PERIOD_US        (500 * USEC_PER_MSEC) // Half of a 1Hz blink period (1 second / 2 == 500ms)
 
 #define PWM_MAX_DUTY_CYCLE        100 // Valid duty cycle range for this application is 0 - 100
+#define LED_PULSE_LUT_SIZE        101 // PWM_MAX_DUTY_CYCLE + 1, spelled out for LISTIFY
+
+#define LED_BLINK_PART_MAX_MS     (UINT32_MAX / USEC_PER_MSEC / 2) // Both parts of a cycle fit in 32 bits of us
+
+#define LED_PULSE_UNKNOWN         UINT32_MAX // The channel's output isn't known, the next commit writes it
+
+#define LED_LAYER_NONE            UINT8_MAX // No layer's request is on the LED
+
+#define LED_SETTINGS_KEY          "led/cfg"
+#define LED_SETTINGS_VERSION      1 // Bump on any change to led_settings, older records are ignored
+
+#define LED_COMMAND_INDEX_MASK    (CONFIG_LED_ASYNC_QUEUE_SIZE - 1) // Ring positions wrap with a mask
+
+#define LED_LEVEL_SHIFT           16 // Fade brightness levels are fixed point, 1 << 16 == 100%
+#define LED_LEVEL_FULL            (1U << LED_LEVEL_SHIFT)
+#define LED_GAMMA_SEGMENT_SHIFT   11 // Gamma table entries are 1 << 11 levels apart
 
 /* ----------------------------------------------------------------------------
                                   Macro Helpers
 ---------------------------------------------------------------------------- */
-#define LED0_NODE             DT_ALIAS(pwm_led0)
-#define LED1_NODE             DT_ALIAS(pwm_led1)
-#define LED2_NODE             DT_ALIAS(pwm_led2)
-#define LED3_NODE             DT_ALIAS(pwm_led3)
-
 #define IS_INVALID_LED(led)   (led >= NUM_LEDS || led < 0)
 
+#define LED_DT_SPEC(node_id)  PWM_DT_SPEC_GET(node_id),
+
+// Subtract duty cycle as leds are active low
+#define LED_DT_PULSE(duty_cycle, node_id) \
+  (DT_PWMS_PERIOD(node_id) - (uint32_t)(((uint64_t)DT_PWMS_PERIOD(node_id) * (duty_cycle)) / PWM_MAX_DUTY_CYCLE))
+#define LED_DT_PULSE_LUT(node_id)  {LISTIFY(LED_PULSE_LUT_SIZE, LED_DT_PULSE, (,), node_id)},
+
+#if defined(CONFIG_LED_TRACE)
+// Two words per event, the tracing backend timestamps it on the same timeline as the kernel
+#define LED_TRACE(name, arg0, arg1)  sys_trace_named_event((name), (uint32_t)(arg0), (uint32_t)(arg1))
+#else
+#define LED_TRACE(name, arg0, arg1)  do { } while (0)
+#endif
+
+#define IS_INVALID_LAYER(layer)  (layer >= CONFIG_LED_NUM_LAYERS)
+
+#define LED_FADE_FRAME_TICKS  k_ms_to_ticks_ceil64(CONFIG_LED_FADE_FRAME_MS)
+#define LED_SLACK_TICKS       k_us_to_ticks_floor64(CONFIG_LED_DEADLINE_SLACK_US)
+
 /* ----------------------------------------------------------------------------
                                     Types
 ---------------------------------------------------------------------------- */
+#if defined(CONFIG_LED_BLINK)
+typedef enum led_blink_part_t {
+  LED_BLINK_ON = 0,
+  LED_BLINK_OFF,
+  NUM_LED_BLINK_PARTS,
+} led_blink_part;
+
 typedef struct led_blink_t {
-  uint16_t half_period; // Units of 10us
-  uint16_t offset; // Units of 10us
+  uint32_t duration_us[NUM_LED_BLINK_PARTS]; // Length of the on and off parts of a cycle
+  k_ticks_t duration[NUM_LED_BLINK_PARTS]; // duration_us in kernel ticks
+  k_ticks_t epoch; // Absolute uptime in ticks a cycle started at, places the blink in a PWM sequence
+  k_ticks_t deadline; // Absolute uptime in ticks of the next toggle
+  led_blink_part part; // Part of the cycle the LED is in
 } led_blink;
 
+typedef struct led_fade_t {
+  k_ticks_t start; // Absolute uptime in ticks the current ramp started at
+  k_ticks_t duration; // Ticks from one end of the ramp to the other
+  uint32_t from; // Brightness level at the start of the ramp
+  uint32_t to; // Brightness level at the end of the ramp
+  uint8_t from_duty_cycle;
+  uint8_t to_duty_cycle; // Duty cycle the LED is left at once the fade ends
+  led_fade_curve curve;
+  bool repeat; // Ramps back and forth until halted
+} led_fade;
+#endif
+
+#if defined(CONFIG_LED_LAYERS)
+typedef struct led_request_t {
+  uint32_t on_us; // Blink on time, 0 for a steady duty cycle
+  uint32_t off_us;
+  uint8_t duty_cycle; // Steady duty cycle, unused while blinking
+} led_request;
+
+typedef struct led_layers_t {
+  led_request requests[CONFIG_LED_NUM_LAYERS];
+  uint32_t mask; // Bit n is set while layer n has a request
+  uint8_t shown; // Layer whose request is on the LED, LED_LAYER_NONE once anything else wrote it
+  uint8_t base_duty_cycle; // Steady duty cycle the LED had when the layers last took it, shown once all are released
+} led_layers;
+#endif
+
+#if defined(CONFIG_LED_ASYNC)
+typedef enum led_command_op_t {
+  LED_COMMAND_TOGGLE = 0,
+  LED_COMMAND_SET,
+  LED_COMMAND_PWM,
+  LED_COMMAND_SET_MASK,
+  LED_COMMAND_BLINK,
+} led_command_op;
+
+typedef struct led_command_t {
+  uint32_t target; // The led_id, or the led_mask of LED_COMMAND_SET_MASK
+  uint32_t value; // State, duty cycle, on_mask or frequency depending on the op
+  led_command_op op;
+} led_command;
+
+typedef struct led_command_slot_t {
+  atomic_t sequence; // Equal to its ring position while free, position + 1 once the command is written
+  led_command command;
+} led_command_slot;
+#endif
+
+#if defined(CONFIG_LED_SETTINGS)
+// Stored as one settings record, packed so its size and layout only change with a version bump
+typedef struct __packed led_settings_t {
+  uint8_t version;
+  uint8_t max_duty_cycles[NUM_LEDS]; // Brightness limit of each LED, every duty cycle is scaled to it
+} led_settings;
+#endif
+
 typedef struct led_t {
-  struct pwm_dt_spec spec; 
+#if defined(CONFIG_LED_BLINK)
   led_blink blink;
+  led_fade fade;
+#endif
+#if defined(CONFIG_LED_LAYERS)
+  led_layers layers;
+#endif
+  uint32_t pulse_ns; // Pulse staged for the next commit
+  uint32_t committed_ns; // Pulse the channel last took, commits skip LEDs whose staged pulse matches it
   uint8_t current_duty_cycle; // Valid from 0 - 100
 } led_type;
 
-typedef struct blink_thread_t {
+#if defined(CONFIG_LED_PM)
+typedef enum led_pm_action_t {
+  LED_PM_KEEP = 0,
+  LED_PM_SUSPEND, // Drop the references once the write is out
+  LED_PM_RESUME, // Take the references before writing
+} led_pm_action;
+#endif
+
+// What one pass of the writer puts on the outputs, taken under _led_lock and written after it is released
+typedef struct led_write_t {
+  uint32_t led_mask; // LEDs whose pulse is written
+  uint32_t failed_mask; // LEDs whose write failed
+  uint32_t pulse_ns[NUM_LEDS]; // Pulses taken for the write, indexed by led_id
+#if defined(CONFIG_LED_BLINK) && defined(CONFIG_LED_PWM_SEQUENCE)
+  led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]; // Waveforms of a reload
+  uint32_t loop_mask; // LEDs whose blink loops in the reloaded sequence
+  bool reload; // Play channels as a new sequence, it holds every LED
+#endif
+#if defined(CONFIG_LED_PM)
+  led_pm_action pm;
+  bool pm_failed; // The suspend or resume didn't happen, the PWM devices are as they were
+#endif
+} led_write;
+
+#if defined(CONFIG_LED_BLINK)
+typedef struct blink_engine_t {
+#if defined(CONFIG_LED_BLINK_THREAD)
   struct k_thread thread;
   k_tid_t id;
-  uint8_t led_bitmask;
-} blink_thread;
+  struct k_sem kick; // Given on every change, the thread sleeps on it until its next deadline
+#elif defined(CONFIG_LED_BLINK_WORKQUEUE)
+  struct k_work_delayable work;
+#elif defined(CONFIG_LED_BLINK_TIMER)
+  struct k_timer timer; // Times the next deadline, its expiry only submits work
+  struct k_work work; // Runs the pass on the system workqueue
+#endif
+  atomic_t led_bitmask;
+  atomic_t fade_bitmask;
+  k_ticks_t fade_deadline; // Absolute uptime in ticks of the next fade frame
+#if defined(CONFIG_LED_PATTERN)
+  atomic_t pattern_bitmask; // LEDs still following the pattern
+  const led_pattern *pattern;
+  uint16_t frame; // Index of the next frame to show
+  uint16_t plays_left; // Plays after the current one, unused by looping patterns
+  k_ticks_t pattern_deadline; // Absolute uptime in ticks of the next frame
+#endif
+  bool sequenced; // Blinking LEDs are looped by the PWM sequence, the engine only runs fades
+} blink_engine;
+#endif
 
 /* ----------------------------------------------------------------------------
                             Private Function Prototypes
 ---------------------------------------------------------------------------- */
-static int _led_pwm_preserve_blink(led_id led, uint8_t duty_cycle);
+static uint32_t _led_duty_to_pulse(led_id led, uint8_t duty_cycle);
+
+static void _led_stage(led_id led, uint8_t duty_cycle);
+
+static void _led_commit(uint32_t led_mask);
+
+static void _led_write_take(void);
+
+static int _led_write_apply(void);
+
+static int _led_write_outputs(void);
+
+static bool _led_write_done(int rv);
+
+static int _led_flush(void);
+
+static uint32_t _led_uncommitted(uint32_t led_mask);
+
+static int _led_update(uint32_t led_mask, const uint8_t duty_cycles[NUM_LEDS]);
+
+static bool _led_halt_effects(uint32_t led_mask);
+
+static void _led_blink_kick(void);
+
+#if defined(CONFIG_LED_PM)
+static bool _led_pm_first_of_device(int led);
+
+static bool _led_pm_idle(void);
+
+static int _led_pm_suspend(void);
+
+static int _led_pm_resume(void);
+
+static void _led_pm_init(void);
+#endif
+
+#if defined(CONFIG_LED_SETTINGS)
+static int _led_settings_read(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param);
+
+static void _led_settings_load(void);
+
+static void _led_settings_save(struct k_work *work);
+#endif
+
+#if defined(CONFIG_LED_BLINK)
+static uint32_t _led_level_to_pulse(led_id led, uint32_t level);
+
+static uint32_t _led_gamma(uint32_t level);
+
+static bool _led_fade_step(led_id led, k_ticks_t now);
+
+static led_blink_part _led_blink_position(const led_blink *blink, k_ticks_t now, uint64_t *remaining_us);
+
+static uint8_t _led_blink_duty(led_blink_part part);
+
+static void _led_blink_start(led_id led, uint32_t on_us, uint32_t off_us, uint32_t phase_us);
+
+static k_ticks_t _led_blink_service(void);
+
+static void _led_blink_update(void);
+
+static int _led_fade_start(led_id led, uint8_t from, uint8_t to, uint32_t duration_ms, led_fade_curve curve, bool repeat);
+
+#if defined(CONFIG_LED_PATTERN)
+static void _led_pattern_step(k_ticks_t now, uint32_t *commit_mask, uint32_t *done_mask);
+#endif
+
+#if defined(CONFIG_LED_LAYERS)
+static void _led_layers_forget(uint32_t led_mask);
+
+static bool _led_layers_show_duty(led_id led, uint8_t duty_cycle);
+
+static bool _led_layers_resolve(led_id led, uint8_t changed_layer);
+
+static int _led_layers_request(led_layer layer, led_id led, const led_request *request);
+#endif
+
+#if defined(CONFIG_LED_ASYNC)
+static int _led_async_push(led_command_op op, uint32_t target, uint32_t value);
+
+static bool _led_async_pop(led_command *command);
+
+static void _led_async_drain(void);
+#endif
+
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+static void _led_seq_build(uint32_t blink_mask, k_ticks_t now, led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]);
+
+static int _led_seq_load(uint32_t blink_mask);
+
+static void _led_seq_release(void);
+#endif
+
+#if defined(CONFIG_LED_BLINK_THREAD)
+static void _led_blink_loop(void *led, void *p2, void *p3);
+#elif defined(CONFIG_LED_BLINK_WORKQUEUE)
+static void _led_blink_work_handler(struct k_work *work);
+#elif defined(CONFIG_LED_BLINK_TIMER)
+static void _led_blink_timer_expiry(struct k_timer *timer);
+
+static void _led_blink_timer_work_handler(struct k_work *work);
+#endif
+#endif
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+BUILD_ASSERT(LED_PULSE_LUT_SIZE == PWM_MAX_DUTY_CYCLE + 1);
+BUILD_ASSERT(NUM_LEDS > 0 && NUM_LEDS <= 16, "led_id stops at LED15 and led_frame masks are 16 bits wide");
+
+// One entry per okay child of the pwm-leds node, in devicetree order
+static const struct pwm_dt_spec _led_specs[NUM_LEDS] = {
+  DT_FOREACH_CHILD_STATUS_OKAY(LED_DT_NODE, LED_DT_SPEC)
+};
+
+// Pulse for every duty cycle of every LED, computed from the devicetree periods at build time
+static const uint32_t _led_pulse_lut[NUM_LEDS][LED_PULSE_LUT_SIZE] = {
+  DT_FOREACH_CHILD_STATUS_OKAY(LED_DT_NODE, LED_DT_PULSE_LUT)
+};
+
+static led_type _leds[NUM_LEDS];
+
+static uint8_t _led_staged_duty_cycles[NUM_LEDS]; // Duty cycles of LED_stage until LED_commit
+static uint32_t _led_dirty_mask; // LEDs staged by LED_stage since the last LED_commit
+
+// Guards the LED state, never held across a driver call. _led_flush writes the outputs once it is released
+static struct k_spinlock _led_lock;
+
+// One context writes the outputs at a time, commits only queue their LEDs for it
+static led_write _led_write; // Only touched by the writing context
+static uint32_t _led_write_mask = 0; // LEDs committed since the writer last took them
+static bool _led_write_pending = false; // A commit is waiting for the writer, set even by a commit of no LED
+static bool _led_writing = false; // A context is in _led_flush writing the outputs
+
+#if defined(CONFIG_LED_SETTINGS)
+// What the LEDs run with, read on every write. Defaults to full brightness until a record is loaded
+static led_settings _led_settings = {
+  .version=LED_SETTINGS_VERSION,
+  .max_duty_cycles={[0 ... NUM_LEDS - 1] = PWM_MAX_DUTY_CYCLE},
+};
+static led_settings _led_settings_saved; // The stored record, a save that matches it is skipped
+
+static K_WORK_DELAYABLE_DEFINE(_led_settings_work, _led_settings_save);
+#endif
+
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+static bool _led_seq_capable = false; // Every LED is a channel of the one sequence capable PWM
+#endif
+
+#if defined(CONFIG_LED_PM)
+static bool _led_pm_enabled = false; // Runtime PM is enabled on every PWM device of the LEDs
+static bool _led_pm_suspended = false; // No reference is held, the PWM devices are suspended. Only changed by the writer
+#endif
+
+#if defined(CONFIG_LED_BLINK)
+static blink_engine _led_blink_engine = {.led_bitmask=ATOMIC_INIT(0), .fade_bitmask=ATOMIC_INIT(0), .sequenced=false};
+
+static led_done_callback _led_done_cb = NULL;
+
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+static bool _led_seq_reload = false; // The sequenced blinks changed, the writer plays a new sequence
+#endif
+
+#if defined(CONFIG_LED_BLINK_THREAD)
+K_THREAD_STACK_DEFINE(_led_blink_stack, CONFIG_LED_BLINK_THREAD_STACK_SIZE);
+#endif
+
+#if defined(CONFIG_LED_ASYNC)
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_LED_ASYNC_QUEUE_SIZE), "LED_ASYNC_QUEUE_SIZE must be a power of two");
+
+// Bounded multi producer ring, producers claim positions by CAS and the engine is its only consumer
+static led_command_slot _led_commands[CONFIG_LED_ASYNC_QUEUE_SIZE];
+static atomic_t _led_command_head = ATOMIC_INIT(0); // Next position a producer claims
+static uint32_t _led_command_tail = 0; // Next position the engine reads, only the engine touches it
+static bool _led_async_ready = false; // The ring slots are numbered, set once by LED_init
+#endif
+
+// Gamma 2.2 brightness curve sampled every 1 << LED_GAMMA_SEGMENT_SHIFT levels
+static const uint32_t _led_gamma_lut[(LED_LEVEL_FULL >> LED_GAMMA_SEGMENT_SHIFT) + 1] = {
+  0, 32, 147, 359, 676, 1104, 1648, 2314, 3104, 4022, 5072, 6255, 7574, 9033, 10632, 12375,
+  14263, 16298, 18482, 20817, 23303, 25944, 28740, 31692, 34803, 38073, 41504, 45097, 48854, 52775,
+  56861, 61115, 65536,
+};
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Converts a duty cycle into the pulse width for the given LED
+ *
+ * @param [in] led the LED the pulse is for
+ * @param [in] duty_cycle the duty cycle to convert, clamped to 0 - 100
+ *
+ * @return Pulse width in ns
+ */
+static uint32_t _led_duty_to_pulse(led_id led, uint8_t duty_cycle) {
+  duty_cycle = MIN(duty_cycle, PWM_MAX_DUTY_CYCLE);
+#if defined(CONFIG_LED_SETTINGS)
+  duty_cycle = (duty_cycle * _led_settings.max_duty_cycles[led]) / PWM_MAX_DUTY_CYCLE;
+#endif
+  return _led_pulse_lut[led][duty_cycle];
+}
+
+/**
+ * @brief Stages the pulse for the given duty cycle, written on the next commit
+ *
+ * @param [in] led the LED to stage
+ * @param [in] duty_cycle the duty cycle to stage
+ */
+static void _led_stage(led_id led, uint8_t duty_cycle) {
+  _leds[led].pulse_ns = _led_duty_to_pulse(led, duty_cycle);
+}
+
+/**
+ * @brief Queues the staged pulse of every LED in the mask for the writer, called with _led_lock held.
+ *        _led_flush writes them in a single update once the lock is released
+ *
+ * @param [in] led_mask bitmask of the LEDs to write, 0 only lets the PWM suspend
+ */
+static void _led_commit(uint32_t led_mask) {
+  LED_TRACE("led_commit", led_mask, 0);
+  _led_write_mask |= led_mask;
+  _led_write_pending = true;
+}
+
+/**
+ * @brief Takes the queued commits into _led_write, called by the writer with _led_lock held.
+ *        Only decides on a suspend or resume, _led_write_apply makes the PM calls
+ */
+static void _led_write_take(void) {
+  uint32_t led_mask = _led_write_mask;
+
+  _led_write_mask = 0;
+  _led_write_pending = false;
+  _led_write.led_mask = 0;
+  _led_write.failed_mask = 0;
+#if defined(CONFIG_LED_BLINK) && defined(CONFIG_LED_PWM_SEQUENCE)
+  _led_write.reload = _led_seq_reload;
+  _led_seq_reload = false;
+#endif
+
+#if defined(CONFIG_LED_PM)
+  _led_write.pm = LED_PM_KEEP;
+  _led_write.pm_failed = false;
+  if (_led_pm_enabled) {
+    if (_led_pm_idle() && _led_pm_suspended) {
+#if defined(CONFIG_LED_BLINK) && defined(CONFIG_LED_PWM_SEQUENCE)
+      _led_write.reload = false;
+#endif
+      // Nothing to show, the sleep pin state keeps every LED off without the PWM running
+      return;
+    } else if (_led_pm_idle()) {
+      // The dark pulses still go out first, so a suspend that fails leaves the LEDs off
+      _led_write.pm = LED_PM_SUSPEND;
+    } else if (_led_pm_suspended) {
+      _led_write.pm = LED_PM_RESUME;
+      // Writes were skipped while suspended, bring every channel back in line with its staged pulse
+      led_mask = LED_ALL_MASK;
+    }
+  }
+#endif
+
+#if defined(CONFIG_LED_BLINK) && defined(CONFIG_LED_PWM_SEQUENCE)
+  if (_led_write.reload) {
+    // The new sequence holds every channel, static ones at their staged pulse
+    k_ticks_t now = k_uptime_ticks();
+    _led_write.loop_mask = _led_blink_engine.sequenced ? atomic_get(&_led_blink_engine.led_bitmask) : 0;
+    _led_seq_build(_led_write.loop_mask, now, _led_write.channels);
+    for (int i = 0; i < NUM_LEDS; i++) {
+      _led_write.pulse_ns[i] = _leds[i].pulse_ns;
+      if (_led_write.loop_mask & BIT(i)) {
+        // The sequence plays the phase rounded to a whole period, a release continues from what it shows
+        _leds[i].blink.epoch = now - k_us_to_ticks_near64(_led_write.channels[_led_specs[i].channel].phase_us);
+      }
+    }
+    return;
+  }
+#endif
+
+  led_mask = _led_uncommitted(led_mask);
+#if defined(CONFIG_LED_BLINK) && defined(CONFIG_LED_PWM_SEQUENCE)
+  if (_led_seq_capable && _led_blink_engine.sequenced) {
+    // The channels are part of the looping blink waveform until their blinks halt
+    led_mask &= ~atomic_get(&_led_blink_engine.led_bitmask);
+  }
+#endif
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (led_mask & BIT(i)) {
+      _led_write.pulse_ns[i] = _leds[i].pulse_ns;
+    }
+  }
+  _led_write.led_mask = led_mask;
+}
+
+/**
+ * @brief Puts _led_write on the outputs with the suspend or resume it needs, called by the writer
+ *        with _led_lock released
+ *
+ * @return Error code, < 0 on failures
+ */
+static int _led_write_apply(void) {
+#if defined(CONFIG_LED_PM)
+  if (LED_PM_RESUME == _led_write.pm) {
+    int rv = _led_pm_resume();
+    if (rv < 0) {
+      _led_write.pm_failed = true;
+      return rv;
+    }
+  }
+
+  int rv = _led_write_outputs();
+  if (LED_PM_SUSPEND == _led_write.pm) {
+    int err = _led_pm_suspend();
+    _led_write.pm_failed = err < 0;
+    rv = (err < 0) ? err : rv;
+  }
+  return rv;
+#else
+  return _led_write_outputs();
+#endif
+}
+
+/**
+ * @brief Writes the pulses or the sequence of _led_write to the channels, with _led_lock released
+ *
+ * @return Error code, < 0 on failures
+ */
+static int _led_write_outputs(void) {
+#if defined(CONFIG_LED_BLINK) && defined(CONFIG_LED_PWM_SEQUENCE)
+  if (_led_write.reload) {
+    return led_pwm_seq_play(_led_write.channels);
+  }
+#endif
+
+  uint32_t led_mask = _led_write.led_mask;
+  if (0 == led_mask) {
+    // Every channel already holds its staged pulse
+    return 0;
+  }
+
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+  if (_led_seq_capable) {
+    uint32_t pulses[LED_PWM_SEQ_CHANNELS] = {0};
+    uint8_t channel_mask = 0;
+
+    for (int i = 0; i < NUM_LEDS; i++) {
+      if (led_mask & BIT(i)) {
+        pulses[_led_specs[i].channel] = _led_write.pulse_ns[i];
+        channel_mask |= BIT(_led_specs[i].channel);
+      }
+    }
+    int rv = led_pwm_seq_write(channel_mask, pulses);
+    _led_write.failed_mask = (rv < 0) ? led_mask : 0;
+    return rv;
+  }
+#endif
+
+  int rv = 0;
+  // The pwm API has no multi channel write, the channels are written back to back
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (led_mask & BIT(i)) {
+      int err = pwm_set_pulse_dt(&_led_specs[i], _led_write.pulse_ns[i]);
+      _led_write.failed_mask |= (err < 0) ? BIT(i) : 0;
+      rv = (err < 0) ? err : rv;
+    }
+  }
+  return rv;
+}
+
+/**
+ * @brief Records what _led_write put on the channels, called by the writer with _led_lock held
+ *
+ * @param [in] rv the result of _led_write_apply
+ *
+ * @return true if the engine needs a kick
+ */
+static bool _led_write_done(int rv) {
+  bool kick = false;
+
+#if defined(CONFIG_LED_PM)
+  if (_led_write.pm_failed && LED_PM_RESUME == _led_write.pm) {
+    // Nothing reached the channels, they are still unknown from the suspend and the next commit resumes again
+#if defined(CONFIG_LED_BLINK) && defined(CONFIG_LED_PWM_SEQUENCE)
+    _led_seq_reload |= _led_write.reload;
+#endif
+    return false;
+  } else if (!_led_write.pm_failed && LED_PM_RESUME == _led_write.pm) {
+    _led_pm_suspended = false;
+  } else if (!_led_write.pm_failed && LED_PM_SUSPEND == _led_write.pm) {
+    _led_pm_suspended = true;
+    for (int i = 0; i < NUM_LEDS; i++) {
+      // Suspending parks the pins in their sleep state, what the channels held is gone
+      _leds[i].committed_ns = LED_PULSE_UNKNOWN;
+    }
+    return false;
+  }
+#endif
+
+#if defined(CONFIG_LED_BLINK) && defined(CONFIG_LED_PWM_SEQUENCE)
+  if (_led_write.reload) {
+    for (int i = 0; i < NUM_LEDS; i++) {
+      // A looping channel has no single pulse, its first static commit has to write it
+      _leds[i].committed_ns = (rv < 0 || (_led_write.loop_mask & BIT(i))) ? LED_PULSE_UNKNOWN : _led_write.pulse_ns[i];
+    }
+    if (rv < 0 && _led_blink_engine.sequenced) {
+      // The blinks passed the check when they were handed over, blink them from the engine regardless
+      _led_seq_release();
+      kick = true;
+    }
+    return kick;
+  }
+#endif
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (_led_write.led_mask & BIT(i)) {
+      // A failed write is retried by the next commit. A pulse staged since the take is already queued again
+      _leds[i].committed_ns = (_led_write.failed_mask & BIT(i)) ? LED_PULSE_UNKNOWN : _led_write.pulse_ns[i];
+    }
+  }
+  return kick;
+}
+
+/**
+ * @brief Writes every queued commit to the outputs, called right after releasing _led_lock by every
+ *        path that commits. Only one context writes at a time and the lock is released around each
+ *        write, a context that finds another one writing leaves its LEDs to that writer, which takes
+ *        every commit queued during its own write before it returns
+ *
+ * @return Error code, < 0 on failures. 0 when the LEDs were left to another writer
+ */
+static int _led_flush(void) {
+  bool kick = false;
+  int rv = 0;
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+
+  if (_led_writing) {
+    k_spin_unlock(&_led_lock, key);
+    return 0;
+  }
+  _led_writing = true;
+
+  while (_led_write_pending) {
+    _led_write_take();
+    k_spin_unlock(&_led_lock, key);
+    int err = _led_write_apply();
+    key = k_spin_lock(&_led_lock);
+    kick |= _led_write_done(err);
+    rv = (err < 0) ? err : rv;
+  }
+  _led_writing = false;
+  k_spin_unlock(&_led_lock, key);
+
+  if (kick) {
+    _led_blink_kick();
+  }
+  return rv;
+}
+
+/**
+ * @brief Filters out the LEDs whose channel already holds their staged pulse
+ *
+ * @param [in] led_mask bitmask of the LEDs to check
+ *
+ * @return bitmask of the LEDs in led_mask that need a write
+ */
+static uint32_t _led_uncommitted(uint32_t led_mask) {
+  uint32_t dirty = 0;
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if ((led_mask & BIT(i)) && _leds[i].pulse_ns != _leds[i].committed_ns) {
+      dirty |= BIT(i);
+    }
+  }
+  return dirty;
+}
+
+/**
+ * @brief Sets LEDs to the given duty cycles, halting their blinks and fades
+ *
+ * @param [in] led_mask bitmask of the LEDs to set
+ * @param [in] duty_cycles the duty cycle of each LED indexed by led_id, expects 0 - 100 only
+ *
+ * @return Error code, < 0 on failures
+ */
+static int _led_update(uint32_t led_mask, const uint8_t duty_cycles[NUM_LEDS]) {
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (led_mask & BIT(i)) {
+      // Kept in line with the pulse so toggles and blinks started later see what is shown
+      _leds[i].current_duty_cycle = MIN(duty_cycles[i], PWM_MAX_DUTY_CYCLE);
+      _led_stage(i, _leds[i].current_duty_cycle);
+    }
+  }
+  // Stage first so a PWM sequence reloaded by the halt already holds the new pulse
+  bool halted = _led_halt_effects(led_mask);
+  _led_commit(led_mask);
+
+  k_spin_unlock(&_led_lock, key);
+
+  int rv = _led_flush();
+  if (halted) {
+    _led_blink_kick();
+  }
+  return rv;
+}
+
+/**
+ * @brief Halts blinking and fading for the given LEDs, called with _led_lock held
+ *
+ * @param [in] led_mask bitmask of the LED instances to halt effects for
+ *
+ * @return true if an effect was halted and the engine needs a kick
+ */
+static bool _led_halt_effects(uint32_t led_mask) {
+#if defined(CONFIG_LED_LAYERS)
+  _led_layers_forget(led_mask);
+#endif
+#if defined(CONFIG_LED_BLINK)
+  bool halted = (atomic_and(&_led_blink_engine.fade_bitmask, ~led_mask) & led_mask) != 0;
+#if defined(CONFIG_LED_PATTERN)
+  // The rest of the pattern plays on without these LEDs
+  halted |= (atomic_and(&_led_blink_engine.pattern_bitmask, ~led_mask) & led_mask) != 0;
+#endif
+
+  if (atomic_and(&_led_blink_engine.led_bitmask, ~led_mask) & led_mask) {
+    _led_blink_update();
+    halted = true;
+  }
+  return halted;
+#else
+  ARG_UNUSED(led_mask);
+  return false;
+#endif
+}
+
+/**
+ * @brief Runs the engine backend right away so it picks up changed blinks and fades.
+ *        Never idles the backend itself, an engine with nothing to time idles on its own
+ *        which is what keeps a concurrent start from being stranded by a stale stop
+ */
+static void _led_blink_kick(void) {
+#if defined(CONFIG_LED_BLINK_THREAD)
+  k_sem_give(&_led_blink_engine.kick);
+#elif defined(CONFIG_LED_BLINK_WORKQUEUE)
+  k_work_reschedule(&_led_blink_engine.work, K_NO_WAIT);
+#elif defined(CONFIG_LED_BLINK_TIMER)
+  // A pass already queued picks the change up, a pending deadline only adds a pass
+  k_work_submit(&_led_blink_engine.work);
+#endif
+}
+
+#if defined(CONFIG_LED_PM)
+/**
+ * @brief Checks if the given LED is the first one on its PWM device, so every device is handled once
+ *
+ * @param [in] led the LED to check
+ *
+ * @return true if no LED before it uses the same PWM device
+ */
+static bool _led_pm_first_of_device(int led) {
+  for (int i = 0; i < led; i++) {
+    if (_led_specs[i].dev == _led_specs[led].dev) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Checks if the PWM can be suspended, called with _led_lock held
+ *
+ * @return true if every LED is dark with no blink or fade left to time
+ */
+static bool _led_pm_idle(void) {
+#if defined(CONFIG_LED_BLINK)
+  if (atomic_get(&_led_blink_engine.led_bitmask) || atomic_get(&_led_blink_engine.fade_bitmask)) {
+    return false;
+  }
+#endif
+#if defined(CONFIG_LED_PATTERN)
+  if (atomic_get(&_led_blink_engine.pattern_bitmask)) {
+    return false;
+  }
+#endif
+  for (int i = 0; i < NUM_LEDS; i++) {
+    // LEDs are active low, any pulse shorter than the period lights the LED
+    if (_leds[i].pulse_ns < _led_specs[i].period) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Drops the references on the PWM devices so they suspend, called by the writer with _led_lock
+ *        released. The PWM driver suspends from the workqueue, a failed put takes the dropped ones back
+ *
+ * @return Error code, < 0 on failures and the references are still held
+ */
+static int _led_pm_suspend(void) {
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+  // The driver stops the peripheral on suspend, the next write after resume loads the sequence again
+  led_pwm_seq_stop();
+#endif
+
+  LED_TRACE("led_pm_suspend", 0, 0);
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (!_led_pm_first_of_device(i)) {
+      continue;
+    }
+    int rv = pm_device_runtime_put_async(_led_specs[i].dev, K_NO_WAIT);
+    if (rv < 0) {
+      for (int j = 0; j < i; j++) {
+        if (_led_pm_first_of_device(j)) {
+          pm_device_runtime_get(_led_specs[j].dev);
+        }
+      }
+      return rv;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Takes references on the PWM devices, resuming them before a write. Called by the writer with
+ *        _led_lock released, a failed get drops the ones already taken
+ *
+ * @return Error code, < 0 on failures and no reference is held
+ */
+static int _led_pm_resume(void) {
+  LED_TRACE("led_pm_resume", 0, 0);
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (!_led_pm_first_of_device(i)) {
+      continue;
+    }
+    // Synchronous, the nRF PWM only reapplies its pin state so a toggle isn't delayed noticeably
+    int rv = pm_device_runtime_get(_led_specs[i].dev);
+    if (rv < 0) {
+      for (int j = 0; j < i; j++) {
+        if (_led_pm_first_of_device(j)) {
+          pm_device_runtime_put_async(_led_specs[j].dev, K_NO_WAIT);
+        }
+      }
+      return rv;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Enables runtime PM on the PWM devices, they stay suspended until an LED is lit
+ */
+static void _led_pm_init(void) {
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (_led_pm_first_of_device(i) && pm_device_runtime_enable(_led_specs[i].dev) < 0) {
+      // A device without PM support keeps running, the LEDs are driven as without LED_PM
+      return;
+    }
+  }
+  _led_pm_enabled = true;
+  _led_pm_suspended = true;
+}
+#endif
+
+#if defined(CONFIG_LED_SETTINGS)
+/**
+ * @brief Reads the stored record of LED_SETTINGS_KEY, records of another size or version are skipped
+ *
+ * @param [in] key the name below LED_SETTINGS_KEY, NULL for the key itself
+ * @param [in] len the size of the stored record
+ * @param [in] read_cb reads the record from the backend
+ * @param [in] cb_arg passed to read_cb
+ * @param [out] param the led_settings to fill
+ *
+ * @return Error code, < 0 on failures
+ */
+static int _led_settings_read(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param) {
+  led_settings stored;
+
+  if (NULL != key || sizeof(stored) != len) {
+    return 0;
+  }
+  if (sizeof(stored) != read_cb(cb_arg, &stored, sizeof(stored)) || LED_SETTINGS_VERSION != stored.version) {
+    return 0;
+  }
+  memcpy(param, &stored, sizeof(stored));
+  return 0;
+}
+
+/**
+ * @brief Loads the stored brightness limits, called once by LED_init after the LEDs are written off
+ *        so the lookup never holds off the first output
+ */
+static void _led_settings_load(void) {
+  led_settings stored = {0};
+
+  if (0 > settings_subsys_init() || 0 > settings_load_subtree_direct(LED_SETTINGS_KEY, _led_settings_read, &stored)) {
+    return;
+  }
+  if (LED_SETTINGS_VERSION != stored.version) {
+    // Nothing stored yet
+    return;
+  }
+  _led_settings_saved = stored;
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  for (int i = 0; i < NUM_LEDS; i++) {
+    _led_settings.max_duty_cycles[i] = MIN(stored.max_duty_cycles[i], PWM_MAX_DUTY_CYCLE);
+  }
+  k_spin_unlock(&_led_lock, key);
+}
+
+/**
+ * @brief Writes the settings as one record from the system workqueue, skipped if nothing changed since the last write
+ *
+ * @param [in] work Unused, the file's only settings work item
+ */
+static void _led_settings_save(struct k_work *work) {
+  led_settings settings;
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  settings = _led_settings;
+  k_spin_unlock(&_led_lock, key);
+
+  if (0 == memcmp(&settings, &_led_settings_saved, sizeof(settings))) {
+    return;
+  }
+  if (0 == settings_save_one(LED_SETTINGS_KEY, &settings, sizeof(settings))) {
+    _led_settings_saved = settings;
+  }
+}
+#endif
+
+#if defined(CONFIG_LED_BLINK)
+/**
+ * @brief Converts a fixed point brightness level into the pulse width for the given LED
+ *
+ * @param [in] led the LED the pulse is for
+ * @param [in] level the brightness level, LED_LEVEL_FULL is fully on
+ *
+ * @return Pulse width in ns
+ */
+static uint32_t _led_level_to_pulse(led_id led, uint32_t level) {
+  uint32_t period = _led_specs[led].period;
+  level = MIN(level, LED_LEVEL_FULL);
+#if defined(CONFIG_LED_SETTINGS)
+  level = (level * _led_settings.max_duty_cycles[led]) / PWM_MAX_DUTY_CYCLE;
+#endif
+  uint32_t on_ns = (uint32_t)(((uint64_t)period * level) >> LED_LEVEL_SHIFT);
+  // Subtract on time as leds are active low
+  return period - on_ns;
+}
+
+/**
+ * @brief Maps a perceived brightness level onto the linear level that produces it
+ *
+ * @param [in] level the perceived brightness level
+ *
+ * @return Linear brightness level
+ */
+static uint32_t _led_gamma(uint32_t level) {
+  uint32_t index = level >> LED_GAMMA_SEGMENT_SHIFT;
+  if (index >= ARRAY_SIZE(_led_gamma_lut) - 1) {
+    return LED_LEVEL_FULL;
+  }
+
+  // Interpolate between the two surrounding samples
+  uint32_t fraction = level & BIT_MASK(LED_GAMMA_SEGMENT_SHIFT);
+  uint32_t low = _led_gamma_lut[index];
+  uint32_t high = _led_gamma_lut[index + 1];
+  return low + (((high - low) * fraction) >> LED_GAMMA_SEGMENT_SHIFT);
+}
+
+/**
+ * @brief Stages the pulse of the given fading LED for the current frame
+ *
+ * @param [in] led the fading LED
+ * @param [in] now the uptime in ticks of the frame
+ *
+ * @return true once the fade has ended
+ */
+static bool _led_fade_step(led_id led, k_ticks_t now) {
+  led_fade *fade = &_leds[led].fade;
+  k_ticks_t elapsed = now - fade->start;
+  uint32_t level = fade->to;
+  bool done = elapsed >= fade->duration;
+
+  if (!done) {
+    int64_t span = (int64_t)fade->to - (int64_t)fade->from;
+    level = fade->from + (int32_t)((span * elapsed) / fade->duration);
+  } else if (fade->repeat) {
+    // End this ramp on its final level then head back the other way
+    uint32_t level_swap = fade->from;
+    uint8_t duty_cycle_swap = fade->from_duty_cycle;
+    fade->from = fade->to;
+    fade->from_duty_cycle = fade->to_duty_cycle;
+    fade->to = level_swap;
+    fade->to_duty_cycle = duty_cycle_swap;
+    fade->start += fade->duration;
+    if (fade->start + fade->duration <= now) {
+      fade->start = now;
+    }
+    done = false;
+  }
+
+  if (LED_FADE_GAMMA == fade->curve) {
+    level = _led_gamma(level);
+  }
+  _leds[led].pulse_ns = _led_level_to_pulse(led, level);
+
+  if (done) {
+    _leds[led].current_duty_cycle = fade->to_duty_cycle;
+  }
+  return done;
+}
+
+/**
+ * @brief Finds where in its cycle a blink is
+ *
+ * @param [in] blink the blink to locate
+ * @param [in] now the uptime in ticks to locate it at
+ * @param [out] remaining_us time left until the blink leaves the part it is in
+ *
+ * @return The part of the cycle the blink is in
+ */
+static led_blink_part _led_blink_position(const led_blink *blink, k_ticks_t now, uint64_t *remaining_us) {
+  uint64_t cycle_us = (uint64_t)blink->duration_us[LED_BLINK_ON] + blink->duration_us[LED_BLINK_OFF];
+  uint64_t position_us = k_ticks_to_us_floor64(now - blink->epoch) % cycle_us;
+
+  if (position_us < blink->duration_us[LED_BLINK_ON]) {
+    *remaining_us = blink->duration_us[LED_BLINK_ON] - position_us;
+    return LED_BLINK_ON;
+  }
+  *remaining_us = cycle_us - position_us;
+  return LED_BLINK_OFF;
+}
+
+/**
+ * @brief Duty cycle an LED is held at during the given part of a blink cycle
+ */
+static uint8_t _led_blink_duty(led_blink_part part) {
+  return (LED_BLINK_ON == part) ? PWM_MAX_DUTY_CYCLE : 0;
+}
+
+/**
+ * @brief Starts blinking the given LED, halting a fade. Called with _led_lock held
+ *
+ * @param [in] led the LED instance to blink
+ * @param [in] on_us length of the on part of a cycle, > 0
+ * @param [in] off_us length of the off part of a cycle, > 0
+ * @param [in] phase_us how far into its cycle the blink starts, the on part starts a cycle
+ */
+static void _led_blink_start(led_id led, uint32_t on_us, uint32_t off_us, uint32_t phase_us) {
+  led_blink *blink = &_leds[led].blink;
+  k_ticks_t now = k_uptime_ticks();
+  uint64_t remaining_us;
+
+  blink->duration_us[LED_BLINK_ON] = on_us;
+  blink->duration_us[LED_BLINK_OFF] = off_us;
+  blink->duration[LED_BLINK_ON] = k_us_to_ticks_near64(on_us);
+  blink->duration[LED_BLINK_OFF] = k_us_to_ticks_near64(off_us);
+  // Backdate the cycle start so the phase offset is where now falls
+  blink->epoch = now - k_us_to_ticks_near64(phase_us % ((uint64_t)on_us + off_us));
+  blink->part = _led_blink_position(blink, now, &remaining_us);
+  blink->deadline = now + k_us_to_ticks_ceil64(remaining_us);
+
+  atomic_clear_bit(&_led_blink_engine.fade_bitmask, led);
+#if defined(CONFIG_LED_PATTERN)
+  atomic_clear_bit(&_led_blink_engine.pattern_bitmask, led);
+#endif
+#if defined(CONFIG_LED_LAYERS)
+  _led_layers_forget(BIT(led));
+#endif
+  // Flag the blink before the write so a blink starting off still keeps the PWM awake
+  atomic_set_bit(&_led_blink_engine.led_bitmask, led);
+  // Show the part the blink starts in, the engine only writes on toggles
+  _leds[led].current_duty_cycle = _led_blink_duty(blink->part);
+  _led_stage(led, _leds[led].current_duty_cycle);
+  _led_commit(BIT(led));
+
+  _led_blink_update();
+}
+
+/**
+ * @brief Runs every blink toggle and fade frame that is due, shared by all engine backends.
+ *        Holds _led_lock for the few microseconds a pass takes, callers never block it for longer
+ *
+ * @return Absolute uptime in ticks of the next deadline, INT64_MAX if nothing is left to time
+ */
+static k_ticks_t _led_blink_service(void) {
+#if defined(CONFIG_LED_ASYNC)
+  // Before the pass so the blinks and fades the commands start are timed by it
+  _led_async_drain();
+#endif
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  k_ticks_t now = k_uptime_ticks();
+  // Anything due within the slack runs on this wakeup rather than arming its own timeout
+  k_ticks_t due = now + LED_SLACK_TICKS;
+  k_ticks_t next_deadline = INT64_MAX;
+  uint32_t blink_mask = _led_blink_engine.sequenced ? 0 : atomic_get(&_led_blink_engine.led_bitmask);
+  uint32_t fade_mask = atomic_get(&_led_blink_engine.fade_bitmask);
+  uint32_t commit_mask = 0;
+  uint32_t done_mask = 0;
+
+  LED_TRACE("led_wake", blink_mask, fade_mask);
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (blink_mask & BIT(i)) {
+      led_blink *blink = &_leds[i].blink;
+      if (blink->deadline <= due) {
+        blink->part = (LED_BLINK_ON == blink->part) ? LED_BLINK_OFF : LED_BLINK_ON;
+        _leds[i].current_duty_cycle = _led_blink_duty(blink->part);
+        _led_stage(i, _leds[i].current_duty_cycle);
+        commit_mask |= BIT(i);
+        // Advance from the deadline rather than from now so toggles don't drift
+        blink->deadline += blink->duration[blink->part];
+        if (blink->deadline <= now) {
+          // Fell more than a whole part behind, resync instead of toggling in a burst
+          blink->deadline = now + blink->duration[blink->part];
+        }
+      }
+      next_deadline = MIN(next_deadline, blink->deadline);
+    }
+  }
+
+  if (fade_mask && _led_blink_engine.fade_deadline <= due) {
+    // One frame advances every fade
+    for (int i = 0; i < NUM_LEDS; i++) {
+      if (fade_mask & BIT(i)) {
+        if (_led_fade_step(i, now)) {
+          fade_mask &= ~BIT(i);
+          done_mask |= BIT(i);
+          atomic_clear_bit(&_led_blink_engine.fade_bitmask, i);
+        }
+        commit_mask |= BIT(i);
+      }
+    }
+    _led_blink_engine.fade_deadline += LED_FADE_FRAME_TICKS;
+    if (_led_blink_engine.fade_deadline <= now) {
+      _led_blink_engine.fade_deadline = now + LED_FADE_FRAME_TICKS;
+    }
+  }
+  if (fade_mask) {
+    next_deadline = MIN(next_deadline, _led_blink_engine.fade_deadline);
+  }
+
+#if defined(CONFIG_LED_PATTERN)
+  if (atomic_get(&_led_blink_engine.pattern_bitmask)) {
+    if (_led_blink_engine.pattern_deadline <= due) {
+      _led_pattern_step(now, &commit_mask, &done_mask);
+    }
+    if (atomic_get(&_led_blink_engine.pattern_bitmask)) {
+      next_deadline = MIN(next_deadline, _led_blink_engine.pattern_deadline);
+    }
+  }
+#endif
+
+  // LEDs due on the same wakeup change together
+  if (commit_mask) {
+    _led_commit(commit_mask);
+  }
+
+  led_done_callback done_cb = _led_done_cb;
+  k_spin_unlock(&_led_lock, key);
+
+  _led_flush();
+
+  // Ticks until the engine wakes again, UINT32_MAX when it idles
+  LED_TRACE("led_sleep", commit_mask, (INT64_MAX == next_deadline) ? UINT32_MAX : next_deadline - now);
+
+  // Outside the lock so the callback is free to call back into the LED API
+  while (done_mask && done_cb) {
+    uint32_t led = __builtin_ctz(done_mask);
+    done_mask &= done_mask - 1;
+    done_cb(led);
+  }
+  return next_deadline;
+}
+
+/**
+ * @brief Hands the blinking LEDs to the PWM sequence when possible, to the engine backend otherwise.
+ *        Called with _led_lock held, the caller kicks the engine once the lock is released
+ */
+static void _led_blink_update(void) {
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+  uint32_t blink_mask = atomic_get(&_led_blink_engine.led_bitmask);
+
+  if (_led_seq_capable && blink_mask) {
+    if (0 == _led_seq_load(blink_mask)) {
+      _led_blink_engine.sequenced = true;
+      return;
+    }
+  }
+  if (_led_blink_engine.sequenced) {
+    _led_seq_release();
+  }
+#endif
+}
+
+/**
+ * @brief Starts fading the given LED, halting its other effects
+ *
+ * @param [in] led the LED instance to fade
+ * @param [in] from the duty cycle to start from
+ * @param [in] to the duty cycle to end the first ramp on
+ * @param [in] duration_ms how long one ramp takes
+ * @param [in] curve how the fade moves between from and to
+ * @param [in] repeat true to ramp back and forth until halted
+ *
+ * @return Error code, < 0 on failures
+ */
+static int _led_fade_start(led_id led, uint8_t from, uint8_t to, uint32_t duration_ms, led_fade_curve curve, bool repeat) {
+  if (IS_INVALID_LED(led)) {
+    return -EINVAL;
+  } else if (curve != LED_FADE_LINEAR && curve != LED_FADE_GAMMA) {
+    return -EINVAL;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+
+  _led_halt_effects(BIT(led));
+
+  led_fade *fade = &_leds[led].fade;
+  fade->from_duty_cycle = MIN(from, PWM_MAX_DUTY_CYCLE);
+  fade->to_duty_cycle = MIN(to, PWM_MAX_DUTY_CYCLE);
+  fade->from = (fade->from_duty_cycle * LED_LEVEL_FULL) / PWM_MAX_DUTY_CYCLE;
+  fade->to = (fade->to_duty_cycle * LED_LEVEL_FULL) / PWM_MAX_DUTY_CYCLE;
+  fade->duration = k_ms_to_ticks_ceil64(duration_ms);
+  fade->start = k_uptime_ticks();
+  fade->curve = curve;
+  fade->repeat = repeat;
+
+  if (!atomic_get(&_led_blink_engine.fade_bitmask)) {
+    // Nothing else is fading, run the first frame right away
+    _led_blink_engine.fade_deadline = fade->start;
+  }
+  atomic_set_bit(&_led_blink_engine.fade_bitmask, led);
+
+  k_spin_unlock(&_led_lock, key);
+
+  // The halt may have queued a new sequence without the LED
+  _led_flush();
+  _led_blink_kick();
+  return 0;
+}
+
+#if defined(CONFIG_LED_PATTERN)
+/**
+ * @brief Shows the due frame of the pattern and any 0 hold frames after it, called with _led_lock held
+ *
+ * @param [in] now the uptime in ticks the engine pass started at
+ * @param [in,out] commit_mask gets the LEDs the frames set
+ * @param [in,out] done_mask gets the LEDs that were still following the pattern when it ended
+ */
+static void _led_pattern_step(k_ticks_t now, uint32_t *commit_mask, uint32_t *done_mask) {
+  const led_pattern *pattern = _led_blink_engine.pattern;
+  uint32_t pattern_mask = atomic_get(&_led_blink_engine.pattern_bitmask);
+
+  // Bounded so a pattern can never keep the engine in here, LED_pattern_play rejects all 0 holds
+  for (int shown = 0; shown <= pattern->num_frames; shown++) {
+    if (_led_blink_engine.frame >= pattern->num_frames) {
+      // The hold of the last frame is over, the LEDs stay on it
+      atomic_clear(&_led_blink_engine.pattern_bitmask);
+      *done_mask |= pattern_mask;
+      return;
+    }
+
+    const led_frame *frame = &pattern->frames[_led_blink_engine.frame++];
+    uint32_t frame_mask = frame->mask & pattern_mask;
+
+    while (frame_mask) {
+      uint32_t led = __builtin_ctz(frame_mask);
+      frame_mask &= frame_mask - 1;
+      _leds[led].current_duty_cycle = MIN(frame->duty_cycles[led], PWM_MAX_DUTY_CYCLE);
+      _led_stage(led, _leds[led].current_duty_cycle);
+      *commit_mask |= BIT(led);
+    }
+
+    if (_led_blink_engine.frame >= pattern->num_frames && (0 == pattern->repeat || _led_blink_engine.plays_left)) {
+      _led_blink_engine.plays_left -= pattern->repeat ? 1 : 0;
+      _led_blink_engine.frame = 0;
+    }
+
+    if (frame->hold_ms) {
+      k_ticks_t hold = k_ms_to_ticks_ceil64(frame->hold_ms);
+      // Frames keep to their own schedule, a pass that fell a whole frame behind resyncs
+      _led_blink_engine.pattern_deadline += hold;
+      if (_led_blink_engine.pattern_deadline <= now) {
+        _led_blink_engine.pattern_deadline = now + hold;
+      }
+      return;
+    }
+  }
+}
+#endif
+
+#if defined(CONFIG_LED_LAYERS)
+/**
+ * @brief Marks LEDs as written outside their layers, so the next layer change puts the winning
+ *        request back. Called with _led_lock held
+ *
+ * @param [in] led_mask bitmask of the LEDs that were written
+ */
+static void _led_layers_forget(uint32_t led_mask) {
+  while (led_mask) {
+    uint32_t led = __builtin_ctz(led_mask);
+    led_mask &= led_mask - 1;
+    _leds[led].layers.shown = LED_LAYER_NONE;
+  }
+}
+
+/**
+ * @brief Holds an LED at a duty cycle, the commit skips the write if the pulse is already shown.
+ *        Called with _led_lock held
+ *
+ * @return true if an effect was halted and the engine needs a kick
+ */
+static bool _led_layers_show_duty(led_id led, uint8_t duty_cycle) {
+  bool halted = _led_halt_effects(BIT(led));
+
+  _leds[led].current_duty_cycle = duty_cycle;
+  _led_stage(led, duty_cycle);
+  _led_commit(BIT(led));
+  return halted;
+}
+
+/**
+ * @brief Puts the request of the highest layer on the LED if it isn't already, called with _led_lock held
+ *
+ * @param [in] led the LED whose layers changed
+ * @param [in] changed_layer the layer whose request changed, LED_LAYER_NONE if only the mask did
+ *
+ * @return true if the engine needs a kick
+ */
+static bool _led_layers_resolve(led_id led, uint8_t changed_layer) {
+  led_layers *layers = &_leds[led].layers;
+  uint8_t top = layers->mask ? (31 - __builtin_clz(layers->mask)) : LED_LAYER_NONE;
+  bool kick = false;
+
+  if (top == layers->shown && top != changed_layer) {
+    // A lower layer changed underneath the one on the LED
+    return false;
+  }
+
+  if (LED_LAYER_NONE == layers->shown) {
+    // The layers take the LED over from a direct write, or from nothing, keep what it showed to go back to
+    layers->base_duty_cycle = _leds[led].current_duty_cycle;
+  }
+
+  if (LED_LAYER_NONE == top) {
+    // The last request was released, hand the LED back as it was before the layers
+    kick = _led_layers_show_duty(led, layers->base_duty_cycle);
+  } else if (layers->requests[top].on_us) {
+    _led_blink_start(led, layers->requests[top].on_us, layers->requests[top].off_us, 0);
+    kick = true;
+  } else {
+    kick = _led_layers_show_duty(led, layers->requests[top].duty_cycle);
+  }
+  // After the write, which forgets the layer it replaces
+  layers->shown = top;
+  return kick;
+}
+
+/**
+ * @brief Stores a layer's request for an LED and resolves the LED
+ *
+ * @return Error code, < 0 on failures
+ */
+static int _led_layers_request(led_layer layer, led_id led, const led_request *request) {
+  if (IS_INVALID_LED(led) || IS_INVALID_LAYER(layer)) {
+    return -EINVAL;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  led_layers *layers = &_leds[led].layers;
+  led_request *stored = &layers->requests[layer];
+  bool changed = !(layers->mask & BIT(layer)) || stored->on_us != request->on_us ||
+    stored->off_us != request->off_us || stored->duty_cycle != request->duty_cycle;
+
+  *stored = *request;
+  layers->mask |= BIT(layer);
+  bool kick = _led_layers_resolve(led, changed ? layer : LED_LAYER_NONE);
+  k_spin_unlock(&_led_lock, key);
+
+  _led_flush();
+  if (kick) {
+    _led_blink_kick();
+  }
+  return 0;
+}
+#endif
+
+#if defined(CONFIG_LED_ASYNC)
+/**
+ * @brief Queues a command for the engine without taking a lock, safe from interrupts
+ *
+ * @param [in] op the command to queue
+ * @param [in] target the led_id, or the led_mask of LED_COMMAND_SET_MASK
+ * @param [in] value the argument of the op
+ *
+ * @return Error code, -EAGAIN if the ring is full
+ */
+static int _led_async_push(led_command_op op, uint32_t target, uint32_t value) {
+  if (!_led_async_ready) {
+    return -ENODEV;
+  }
+
+  while (1) {
+    atomic_val_t pos = atomic_get(&_led_command_head);
+    led_command_slot *slot = &_led_commands[pos & LED_COMMAND_INDEX_MASK];
+    int32_t lag = (int32_t)((uint32_t)atomic_get(&slot->sequence) - (uint32_t)pos);
+
+    if (lag < 0) {
+      // The engine hasn't read this slot since the last lap
+      LED_TRACE("led_async_drop", target, op);
+      return -EAGAIN;
+    } else if (0 == lag && atomic_cas(&_led_command_head, pos, pos + 1)) {
+      slot->command = (led_command){.target=target, .value=value, .op=op};
+      // Publishes the command, the engine only reads a slot once its sequence moves on
+      atomic_set(&slot->sequence, pos + 1);
+      break;
+    }
+    // Another producer claimed the position first, retry with the next one
+  }
+
+  _led_blink_kick();
+  return 0;
+}
+
+/**
+ * @brief Takes the oldest command off the ring, only called by the engine
+ *
+ * @param [out] command filled with the command
+ *
+ * @return true if a command was taken, false if the ring is empty or its oldest slot is still being written
+ */
+static bool _led_async_pop(led_command *command) {
+  led_command_slot *slot = &_led_commands[_led_command_tail & LED_COMMAND_INDEX_MASK];
+
+  if ((uint32_t)atomic_get(&slot->sequence) != _led_command_tail + 1) {
+    return false;
+  }
+  *command = slot->command;
+  // Frees the slot for the producer a lap ahead
+  atomic_set(&slot->sequence, _led_command_tail + CONFIG_LED_ASYNC_QUEUE_SIZE);
+  _led_command_tail++;
+  return true;
+}
+
+/**
+ * @brief Runs every queued command through the regular API in the order it was queued,
+ *        called without _led_lock held by the engine before a pass. Never called from an ISR
+ */
+static void _led_async_drain(void) {
+  led_command command;
+
+  while (_led_async_pop(&command)) {
+    LED_TRACE("led_async_run", command.target, command.op);
+    switch (command.op) {
+      case LED_COMMAND_TOGGLE:
+        LED_toggle(command.target);
+        break;
+      case LED_COMMAND_SET:
+        LED_set(command.target, command.value);
+        break;
+      case LED_COMMAND_PWM:
+        LED_pwm(command.target, command.value);
+        break;
+      case LED_COMMAND_SET_MASK:
+        LED_set_mask(command.target, command.value);
+        break;
+      case LED_COMMAND_BLINK:
+        LED_blink(command.target, command.value);
+        break;
+      default:
+        break;
+    }
+  }
+}
+#endif
 
-static void _led_halt_blink(led_id led);
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+/**
+ * @brief Builds the PWM sequence waveform of every LED, called with _led_lock held
+ *
+ * @param [in] blink_mask bitmask of the LEDs to loop their blink for, the rest hold their staged pulse
+ * @param [in] now the uptime in ticks the sequence starts at
+ * @param [out] channels filled with the waveform of every channel
+ */
+static void _led_seq_build(uint32_t blink_mask, k_ticks_t now, led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]) {
+  memset(channels, 0, sizeof(led_pwm_seq_channel) * LED_PWM_SEQ_CHANNELS);
 
-static void _led_blink_loop(void *led, void *p2, void *p3);
+  for (int i = 0; i < NUM_LEDS; i++) {
+    led_pwm_seq_channel *wave = &channels[_led_specs[i].channel];
 
-/* ----------------------------------------------------------------------------
-                                Global States
----------------------------------------------------------------------------- */
-static led_type _led0 = {.spec=PWM_DT_SPEC_GET(LED0_NODE), .current_duty_cycle=0};
-static led_type _led1 = {.spec=PWM_DT_SPEC_GET(LED1_NODE), .current_duty_cycle=0};
-static led_type _led2 = {.spec=PWM_DT_SPEC_GET(LED2_NODE), .current_duty_cycle=0};
-static led_type _led3 = {.spec=PWM_DT_SPEC_GET(LED3_NODE), .current_duty_cycle=0};
-static led_type *_leds[NUM_LEDS] = {&_led0, &_led1, &_led2, &_led3};
+    if (blink_mask & BIT(i)) {
+      led_blink *blink = &_leds[i].blink;
+      uint64_t cycle_us = (uint64_t)blink->duration_us[LED_BLINK_ON] + blink->duration_us[LED_BLINK_OFF];
 
-static blink_thread _led_blink_thread = {.led_bitmask=0};
-K_THREAD_STACK_DEFINE(_led_blink_stack, LED_BLINK_STACK_SIZE);
+      for (int part = 0; part < NUM_LED_BLINK_PARTS; part++) {
+        wave->pulse_ns[part] = _led_duty_to_pulse(i, _led_blink_duty(part));
+        wave->duration_us[part] = blink->duration_us[part];
+      }
+      // Resume each LED where it is in its cycle rather than restarting it. The sequence only
+      // starts on whole PWM periods, rounding to the nearest one shifts the blink by under half a period
+      uint64_t period_us = _led_specs[i].period / NSEC_PER_USEC;
+      uint64_t phase_us = k_ticks_to_us_floor64(now - blink->epoch) % cycle_us;
+      wave->phase_us = (period_us ? ((phase_us + period_us / 2) / period_us) * period_us : phase_us) % cycle_us;
+    } else {
+      wave->pulse_ns[0] = _leds[i].pulse_ns;
+      wave->pulse_ns[1] = _leds[i].pulse_ns;
+    }
+  }
+}
 
-/* ----------------------------------------------------------------------------
-                              Private Functions
----------------------------------------------------------------------------- */
 /**
- * @brief Sets the LED to the given duty cycle, doesn't halt blinking
- * 
- * @param [in] led the LED to set the duty cycle of
- * @param [in] duty_cycle the duty cycle to set the LED to
- * 
- * @return Error code, < 0 on failures
+ * @brief Queues a new PWM sequence for the writer if the blinking LEDs fit in one, called with _led_lock held.
+ *        The writer builds the waveforms again when it plays them, so every LED resumes where it is by then
+ *
+ * @param [in] blink_mask bitmask of the LEDs to loop their blink for, the rest hold their staged pulse
+ *
+ * @return Error code, < 0 if the blinking LEDs can't be played by the sequence
  */
-static int _led_pwm_preserve_blink(led_id led, uint8_t duty_cycle) {
-  if (IS_INVALID_LED(led)) {
-    return -EINVAL;
+static int _led_seq_load(uint32_t blink_mask) {
+  led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS];
+
+  _led_seq_build(blink_mask, k_uptime_ticks(), channels);
+  int rv = led_pwm_seq_check(channels);
+  if (0 == rv) {
+    _led_seq_reload = true;
+    _led_write_pending = true;
   }
-  uint8_t clamped_duty_cycle = PWM_MAX_DUTY_CYCLE < duty_cycle ? PWM_MAX_DUTY_CYCLE : duty_cycle;
-  uint32_t pwm_step = _leds[led]->spec.period / PWM_MAX_DUTY_CYCLE;
-  // Subtract clamped duty cycle as leds are active low
-  return pwm_set_pulse_dt(&_leds[led]->spec, pwm_step * (PWM_MAX_DUTY_CYCLE - clamped_duty_cycle));
+  return rv;
 }
 
 /**
- * @brief Halts blinking for the given LED
- * 
- * @param [in] led the LED instance to halt blinking for
+ * @brief Hands the blinking LEDs from the PWM sequence to the engine backend, called with _led_lock held
  */
-static void _led_halt_blink(led_id led) {
-  if (IS_INVALID_LED(led)) {
-    return;
-  }
+static void _led_seq_release(void) {
+  k_ticks_t now = k_uptime_ticks();
 
-  _led_blink_thread.led_bitmask &= ~BIT(led);
-  if (!_led_blink_thread.led_bitmask) {
-    k_thread_suspend(_led_blink_thread.id);
+  _led_blink_engine.sequenced = false;
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (atomic_get(&_led_blink_engine.led_bitmask) & BIT(i)) {
+      // Continue the blink from the part the sequence was in
+      led_blink *blink = &_leds[i].blink;
+      uint64_t remaining_us;
+
+      blink->part = _led_blink_position(blink, now, &remaining_us);
+      blink->deadline = now + k_us_to_ticks_ceil64(remaining_us);
+      _leds[i].current_duty_cycle = _led_blink_duty(blink->part);
+      _led_stage(i, _leds[i].current_duty_cycle);
+    }
   }
+
+  // Swap the blink waveforms for the static pulses the engine toggles from here on
+  _led_seq_load(0);
 }
+#endif
 
+#if defined(CONFIG_LED_BLINK_THREAD)
 /**
- * @brief Handles blinking all LEDs
- * 
+ * @brief Handles blinking and fading all LEDs, sleeps until the earliest toggle or fade frame deadline
+ *
  * @param [in] p1 Unused thread parameter 1
  * @param [in] p2 Unused thread parameter 2
  * @param [in] p2 Unused thread parameter 3
  */
 static void _led_blink_loop(void *p1 __attribute__((unused)), void *p2 __attribute__((unused)), void *p3 __attribute__((unused))) {
-  uint16_t min_half_period = LED_COUNTER_HALF_PERIOD / LED_16HZ;
-
   while (1) {
-    k_msleep(min_half_period / LED_COUNTER_UNIT);
+    k_ticks_t next_deadline = _led_blink_service();
 
-    for (int i = 0; i < NUM_LEDS; i++) {
-      if (_led_blink_thread.led_bitmask & BIT(i)) {
-        _leds[i]->blink.offset += min_half_period;
-        if (_leds[i]->blink.offset >= _leds[i]->blink.half_period){
-          _leds[i]->blink.offset = 0;
-          LED_toggle(i);
-        }
-      }
-    }
+    // A kick given since the pass above stays in the semaphore, so no change is ever slept through
+    k_sem_take(&_led_blink_engine.kick, (INT64_MAX == next_deadline) ? K_FOREVER : K_TIMEOUT_ABS_TICKS(next_deadline));
+  }
+}
+#elif defined(CONFIG_LED_BLINK_WORKQUEUE)
+/**
+ * @brief Handles blinking and fading all LEDs from the system workqueue, requeues itself for the next deadline
+ *
+ * @param [in] work The k_work struct contained by the engine's k_work_delayable
+ */
+static void _led_blink_work_handler(struct k_work *work) {
+  k_ticks_t next_deadline = _led_blink_service();
+
+  if (INT64_MAX != next_deadline) {
+    // Schedule rather than reschedule so a kick queued while this pass ran isn't pushed back
+    k_work_schedule(k_work_delayable_from_work(work), K_TIMEOUT_ABS_TICKS(next_deadline));
+  }
+}
+#elif defined(CONFIG_LED_BLINK_TIMER)
+/**
+ * @brief Hands the due deadline to the system workqueue, the PWM and PM calls of a pass never run in the ISR
+ *
+ * @param [in] timer The engine's k_timer
+ */
+static void _led_blink_timer_expiry(struct k_timer *timer) {
+  k_work_submit(&_led_blink_engine.work);
+}
+
+/**
+ * @brief Handles blinking and fading all LEDs from the system workqueue, restarts the timer for the next deadline
+ *
+ * @param [in] work The engine's k_work
+ */
+static void _led_blink_timer_work_handler(struct k_work *work) {
+  k_ticks_t next_deadline = _led_blink_service();
+
+  if (INT64_MAX != next_deadline) {
+    k_timer_start(&_led_blink_engine.timer, K_TIMEOUT_ABS_TICKS(next_deadline), K_NO_WAIT);
   }
 }
+#endif
+#endif
 
 /* ----------------------------------------------------------------------------
                               Public Functions
 ---------------------------------------------------------------------------- */
 /**
  * @brief Inits all LEDs
- * 
+ *
  * @return Error code, < 0 on failures
  */
 int LED_init() {
   for (int i = 0; i < NUM_LEDS; i++) {
-    int rv = pwm_is_ready_dt(&_leds[i]->spec);
+    if (!pwm_is_ready_dt(&_led_specs[i])) {
+      return -ENODEV;
+    }
+  }
+
+#if defined(CONFIG_LED_PM)
+  // Before the first write so an all off start never wakes the PWM
+  _led_pm_init();
+#endif
+
+  // Start from a known off state so the last written pulse is always valid
+  for (int i = 0; i < NUM_LEDS; i++) {
+    _led_stage(i, 0);
+    _leds[i].committed_ns = LED_PULSE_UNKNOWN;
+#if defined(CONFIG_LED_LAYERS)
+    _leds[i].layers.shown = LED_LAYER_NONE;
+#endif
+  }
+  _led_commit(LED_ALL_MASK);
+  int rv = _led_flush();
+  if (rv < 0) {
+    return rv;
+  }
+
+#if defined(CONFIG_LED_SETTINGS)
+  // Off is off at any limit, so loading after the first write doesn't change what is shown
+  _led_settings_load();
+#endif
+
+#if defined(CONFIG_LED_PWM_SEQUENCE)
+  _led_seq_capable = true;
+  for (int i = 0; i < NUM_LEDS; i++) {
+    if (0 > led_pwm_seq_add_channel(&_led_specs[i])) {
+      // Mixed PWM instances, blink from the engine backend instead
+      _led_seq_capable = false;
+    }
+  }
+  if (_led_seq_capable) {
+    // From here on the sequence owns the outputs, start it with the off state
+    _led_commit(LED_ALL_MASK);
+    rv = _led_flush();
     if (rv < 0) {
       return rv;
     }
   }
+#endif
 
-  _led_blink_thread.id = k_thread_create(
-    &_led_blink_thread.thread,
+#if defined(CONFIG_LED_ASYNC)
+  for (int i = 0; i < CONFIG_LED_ASYNC_QUEUE_SIZE; i++) {
+    atomic_set(&_led_commands[i].sequence, i);
+  }
+  _led_async_ready = true;
+#endif
+
+#if defined(CONFIG_LED_BLINK_THREAD)
+  k_sem_init(&_led_blink_engine.kick, 0, 1);
+  _led_blink_engine.id = k_thread_create(
+    &_led_blink_engine.thread,
     _led_blink_stack,
     K_THREAD_STACK_SIZEOF(_led_blink_stack),
     _led_blink_loop,
     NULL, NULL, NULL,
-    LED_BLINK_PRIORITY,
+    CONFIG_LED_BLINK_THREAD_PRIORITY,
     0,
     K_NO_WAIT
   );
-  k_thread_suspend(_led_blink_thread.id);
-  
+  // Lets stack and CPU reports and trace timelines tell the engine apart
+  k_thread_name_set(_led_blink_engine.id, "led_blink");
+#elif defined(CONFIG_LED_BLINK_WORKQUEUE)
+  k_work_init_delayable(&_led_blink_engine.work, _led_blink_work_handler);
+#elif defined(CONFIG_LED_BLINK_TIMER)
+  k_work_init(&_led_blink_engine.work, _led_blink_timer_work_handler);
+  k_timer_init(&_led_blink_engine.timer, _led_blink_timer_expiry, NULL);
+#endif
+
   return 0;
 }
 
 /**
  * @brief Toggle specified LED
- * 
+ *
  * @param [in] led The LED instance to toggle
- * 
+ *
  * @return Error code, < 0 on failures
  */
 int LED_toggle(led_id led) {
+  LED_TRACE("led_toggle", led, 0);
   if (IS_INVALID_LED(led)) {
     return -EINVAL;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  if (0 == _leds[led].current_duty_cycle) {
+    _leds[led].current_duty_cycle = PWM_MAX_DUTY_CYCLE;
   } else {
-    if (0 == _leds[led]->current_duty_cycle) {
-      _leds[led]->current_duty_cycle = PWM_MAX_DUTY_CYCLE;
-    } else {
-      _leds[led]->current_duty_cycle = 0;
-    }
-    return _led_pwm_preserve_blink(led, _leds[led]->current_duty_cycle);
+    _leds[led].current_duty_cycle = 0;
   }
+  // Doesn't halt blinking, the next toggle of a blink flips from here
+  _led_stage(led, _leds[led].current_duty_cycle);
+#if defined(CONFIG_LED_LAYERS)
+  _led_layers_forget(BIT(led));
+#endif
+  _led_commit(BIT(led));
+  k_spin_unlock(&_led_lock, key);
+
+  return _led_flush();
 }
 
 /**
  * @brief Set specified LED to given state
- * 
+ *
  * @param [in] led The LED instance to set
  * @param [in] new_state The state to set the led to
- * 
+ *
  * @return Error code, < 0 on failures
  */
 int LED_set(led_id led, led_state new_state) {
+  LED_TRACE("led_set", led, new_state);
+  uint8_t duty_cycles[NUM_LEDS] = {0};
+
   if (IS_INVALID_LED(led)) {
     return -EINVAL;
   }
 
-  _led_halt_blink(led);
-
-  _leds[led]->current_duty_cycle = (0 == new_state) ? 0 : PWM_MAX_DUTY_CYCLE;
-  return LED_pwm(led, _leds[led]->current_duty_cycle);
+  duty_cycles[led] = (0 == new_state) ? 0 : PWM_MAX_DUTY_CYCLE;
+  return _led_update(BIT(led), duty_cycles);
 }
 
 /**
  * @brief Set specified LED to given pwm duty cycle
- * 
+ *
  * @param [in] led The LED instance to set the pwm duty cycle of
  * @param [in] duty_cycle The duty cycle to set the LED to, expects 0 - 100 only
- * 
+ *
  * @return Error code, < 0 on failures
  */
 int LED_pwm(led_id led, uint8_t duty_cycle) {
+  LED_TRACE("led_pwm", led, duty_cycle);
+  uint8_t duty_cycles[NUM_LEDS] = {0};
+
+  if (IS_INVALID_LED(led)) {
+    return -EINVAL;
+  }
+
+  duty_cycles[led] = duty_cycle;
+  return _led_update(BIT(led), duty_cycles);
+}
+
+/**
+ * @brief Set specified LED to a raw pulse width, skips the duty cycle conversion
+ *
+ * @param [in] led The LED instance to set the pulse of
+ * @param [in] pulse_ns The pulse width written to the channel as is, clamped to the PWM period.
+ *                      LEDs are active low so a longer pulse is dimmer
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_pwm_pulse_ns(led_id led, uint32_t pulse_ns) {
+  LED_TRACE("led_pwm_pulse_ns", led, pulse_ns);
+  if (IS_INVALID_LED(led)) {
+    return -EINVAL;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+
+  _leds[led].pulse_ns = MIN(pulse_ns, _led_specs[led].period);
+  // Any pulse shorter than the period lights the LED, toggling from here turns it off
+  _leds[led].current_duty_cycle = (_leds[led].pulse_ns < _led_specs[led].period) ? PWM_MAX_DUTY_CYCLE : 0;
+  bool halted = _led_halt_effects(BIT(led));
+  _led_commit(BIT(led));
+
+  k_spin_unlock(&_led_lock, key);
+
+  int rv = _led_flush();
+  if (halted) {
+    _led_blink_kick();
+  }
+  return rv;
+}
+
+/**
+ * @brief Set several LEDs to given pwm duty cycles, all of them change in the same update
+ *
+ * @param [in] led_mask Bitmask of the LED instances to set, BIT(LEDx)
+ * @param [in] duty_cycles The duty cycle of each LED indexed by led_id, expects 0 - 100 only
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_pwm_multi(uint32_t led_mask, const uint8_t duty_cycles[NUM_LEDS]) {
+  LED_TRACE("led_pwm_multi", led_mask, 0);
+  if (led_mask & ~LED_ALL_MASK) {
+    return -EINVAL;
+  }
+
+  return _led_update(led_mask, duty_cycles);
+}
+
+/**
+ * @brief Set several LEDs on or off, all of them change in the same update
+ *
+ * @param [in] led_mask Bitmask of the LED instances to set, BIT(LEDx)
+ * @param [in] on_mask Bitmask of the LEDs in led_mask to turn on, the others are turned off
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_set_mask(uint32_t led_mask, uint32_t on_mask) {
+  LED_TRACE("led_set_mask", led_mask, on_mask);
+  uint8_t duty_cycles[NUM_LEDS] = {0};
+
+  if (led_mask & ~LED_ALL_MASK) {
+    return -EINVAL;
+  }
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    duty_cycles[i] = (on_mask & BIT(i)) ? PWM_MAX_DUTY_CYCLE : 0;
+  }
+  return _led_update(led_mask, duty_cycles);
+}
+
+/**
+ * @brief Stages a duty cycle for an LED without writing it, LED_commit applies every staged LED
+ *        in one update. Staging the same LED again before the commit replaces its duty cycle
+ *
+ * @param [in] led The LED instance to stage
+ * @param [in] duty_cycle The duty cycle to stage, expects 0 - 100 only
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_stage(led_id led, uint8_t duty_cycle) {
+  LED_TRACE("led_stage", led, duty_cycle);
   if (IS_INVALID_LED(led)) {
     return -EINVAL;
   }
 
-  _led_halt_blink(led);
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  _led_staged_duty_cycles[led] = duty_cycle;
+  _led_dirty_mask |= BIT(led);
+  k_spin_unlock(&_led_lock, key);
+  return 0;
+}
+
+/**
+ * @brief Applies every LED staged since the last commit in a single update, as LED_pwm_multi.
+ *        Only the LEDs whose pulse changed are written
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_commit() {
+  uint8_t duty_cycles[NUM_LEDS];
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  uint32_t led_mask = _led_dirty_mask;
+  memcpy(duty_cycles, _led_staged_duty_cycles, sizeof(duty_cycles));
+  _led_dirty_mask = 0;
+  k_spin_unlock(&_led_lock, key);
+
+  LED_TRACE("led_commit_staged", led_mask, 0);
+  if (0 == led_mask) {
+    return 0;
+  }
+  return _led_update(led_mask, duty_cycles);
+}
+
+#if defined(CONFIG_LED_SETTINGS)
+/**
+ * @brief Limits the brightness of an LED, every duty cycle it is given is scaled to the limit.
+ *        Saved to flash CONFIG_LED_SETTINGS_SAVE_DELAY_MS later together with any other change
+ *
+ * @param [in] led The LED instance to limit
+ * @param [in] max_duty_cycle The duty cycle a request of 100 shows, expects 0 - 100 only
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_set_max_duty_cycle(led_id led, uint8_t max_duty_cycle) {
+  LED_TRACE("led_set_max_duty_cycle", led, max_duty_cycle);
+  if (IS_INVALID_LED(led) || max_duty_cycle > PWM_MAX_DUTY_CYCLE) {
+    return -EINVAL;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  _led_settings.max_duty_cycles[led] = max_duty_cycle;
+  uint32_t effect_mask = 0;
+#if defined(CONFIG_LED_BLINK)
+  effect_mask = atomic_get(&_led_blink_engine.led_bitmask) | atomic_get(&_led_blink_engine.fade_bitmask);
+#if defined(CONFIG_LED_PATTERN)
+  effect_mask |= atomic_get(&_led_blink_engine.pattern_bitmask);
+#endif
+#endif
+  if (!(effect_mask & BIT(led))) {
+    // A steady LED is rewritten at the new limit, effects pick it up from their next step
+    _led_stage(led, _leds[led].current_duty_cycle);
+    _led_commit(BIT(led));
+  }
+#if defined(CONFIG_LED_BLINK)
+  if (_led_blink_engine.sequenced && (atomic_get(&_led_blink_engine.led_bitmask) & BIT(led))) {
+    // A looped blink has no next step, its waveform is rebuilt with the new pulses
+    _led_blink_update();
+  }
+#endif
+  k_spin_unlock(&_led_lock, key);
+
+  int rv = _led_flush();
+  // Schedule rather than reschedule so a steady stream of changes can't hold the save off
+  k_work_schedule(&_led_settings_work, K_MSEC(CONFIG_LED_SETTINGS_SAVE_DELAY_MS));
+  return rv;
+}
 
-  return _led_pwm_preserve_blink(led, duty_cycle);
+/**
+ * @brief Gets the brightness limit of an LED
+ *
+ * @param [in] led The LED instance to read
+ *
+ * @return The limit as a duty cycle 0 - 100, < 0 on failures
+ */
+int LED_get_max_duty_cycle(led_id led) {
+  if (IS_INVALID_LED(led)) {
+    return -EINVAL;
+  }
+  return _led_settings.max_duty_cycles[led];
 }
+#endif
 
+#if defined(CONFIG_LED_BLINK)
 /**
  * @brief Blinks the given LED at the given frequency
- * 
+ *
  * @param [in] led The LED instance to blink
  * @param [in] frequency The frequency to blink the led at
  */
 void LED_blink(led_id led, led_frequency frequency) {
+  LED_TRACE("led_blink", led, frequency);
   if (IS_INVALID_LED(led)) {
     return;
   } else if (frequency > LED_16HZ || frequency <= 0) {
     return;
   }
 
-  _leds[led]->blink.half_period = LED_COUNTER_HALF_PERIOD / frequency;
-  _leds[led]->blink.offset = 0;
+  uint32_t half_period_us = LED_HALF_PERIOD_US / frequency;
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  // Hold the current state for the first half period
+  _led_blink_start(led, half_period_us, half_period_us, (0 == _leds[led].current_duty_cycle) ? half_period_us : 0);
+  k_spin_unlock(&_led_lock, key);
+
+  _led_flush();
+  _led_blink_kick();
+}
+
+/**
+ * @brief Blinks the given LED with arbitrary on and off times
+ *
+ * @param [in] led The LED instance to blink
+ * @param [in] on_ms How long the LED is on each cycle
+ * @param [in] off_ms How long the LED is off each cycle
+ * @param [in] phase_ms How far into its cycle the blink starts, a cycle starts with the on time.
+ *                      Blinks started together with different phases stay offset from each other
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_blink_ms(led_id led, uint32_t on_ms, uint32_t off_ms, uint32_t phase_ms) {
+  LED_TRACE("led_blink_ms", led, on_ms);
+  if (IS_INVALID_LED(led)) {
+    return -EINVAL;
+  } else if (0 == on_ms || 0 == off_ms) {
+    // Without both parts it is a steady state, use LED_set
+    return -EINVAL;
+  } else if (on_ms > LED_BLINK_PART_MAX_MS || off_ms > LED_BLINK_PART_MAX_MS) {
+    return -EINVAL;
+  }
+
+  uint32_t on_us = on_ms * USEC_PER_MSEC;
+  uint32_t off_us = off_ms * USEC_PER_MSEC;
+  uint32_t phase_us = (uint32_t)(((uint64_t)phase_ms * USEC_PER_MSEC) % ((uint64_t)on_us + off_us));
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  _led_blink_start(led, on_us, off_us, phase_us);
+  k_spin_unlock(&_led_lock, key);
+
+  int rv = _led_flush();
+  _led_blink_kick();
+  return rv;
+}
+
+/**
+ * @brief Fades the given LED from one duty cycle to another
+ *
+ * @param [in] led The LED instance to fade
+ * @param [in] from The duty cycle to start from, expects 0 - 100 only
+ * @param [in] to The duty cycle to end on and hold, expects 0 - 100 only
+ * @param [in] duration_ms How long the fade takes
+ * @param [in] curve How the fade moves between from and to, with LED_FADE_GAMMA they are perceived brightness
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_fade(led_id led, uint8_t from, uint8_t to, uint32_t duration_ms, led_fade_curve curve) {
+  LED_TRACE("led_fade", led, duration_ms);
+  return _led_fade_start(led, from, to, duration_ms, curve, false);
+}
+
+/**
+ * @brief Sets the function called whenever a fade or pattern ends, runs in the engine backend's context,
+ *        the engine thread or the system workqueue
+ *
+ * @param [in] callback Called with the LED whose fade or pattern ended, NULL to stop the calls
+ */
+void LED_set_done_callback(led_done_callback callback) {
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  _led_done_cb = callback;
+  k_spin_unlock(&_led_lock, key);
+}
+
+/**
+ * @brief Breathes the given LED, fading back and forth between two duty cycles until halted
+ *
+ * @param [in] led The LED instance to breathe
+ * @param [in] low The perceived brightness at the bottom of the breath, expects 0 - 100 only
+ * @param [in] high The perceived brightness at the top of the breath, expects 0 - 100 only
+ * @param [in] period_ms The length of one full breath
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_breathe(led_id led, uint8_t low, uint8_t high, uint32_t period_ms) {
+  LED_TRACE("led_breathe", led, period_ms);
+  if (period_ms < 2 * CONFIG_LED_FADE_FRAME_MS) {
+    return -EINVAL;
+  }
+
+  return _led_fade_start(led, low, high, period_ms / 2, LED_FADE_GAMMA, true);
+}
+#endif
+
+#if defined(CONFIG_LED_LAYERS)
+/**
+ * @brief Requests a steady duty cycle for an LED on a layer. The LED shows the request of its
+ *        highest layer, a request below it is only stored and costs no PWM write
+ *
+ * @param [in] layer The layer of the caller, 0 - CONFIG_LED_NUM_LAYERS - 1
+ * @param [in] led The LED instance to request
+ * @param [in] duty_cycle The duty cycle to hold, expects 0 - 100 only
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_layer_set(led_layer layer, led_id led, uint8_t duty_cycle) {
+  LED_TRACE("led_layer_set", led, layer);
+  led_request request = {.duty_cycle=MIN(duty_cycle, PWM_MAX_DUTY_CYCLE)};
+  return _led_layers_request(layer, led, &request);
+}
+
+/**
+ * @brief Requests a blink for an LED on a layer, the blink starts with its on time each time
+ *        the layer takes the LED over
+ *
+ * @param [in] layer The layer of the caller, 0 - CONFIG_LED_NUM_LAYERS - 1
+ * @param [in] led The LED instance to request
+ * @param [in] on_ms How long the LED is on each cycle
+ * @param [in] off_ms How long the LED is off each cycle
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_layer_blink_ms(led_layer layer, led_id led, uint32_t on_ms, uint32_t off_ms) {
+  LED_TRACE("led_layer_blink_ms", led, layer);
+  if (0 == on_ms || 0 == off_ms || on_ms > LED_BLINK_PART_MAX_MS || off_ms > LED_BLINK_PART_MAX_MS) {
+    return -EINVAL;
+  }
+  led_request request = {.on_us=on_ms * USEC_PER_MSEC, .off_us=off_ms * USEC_PER_MSEC};
+  return _led_layers_request(layer, led, &request);
+}
+
+/**
+ * @brief Drops a layer's requests, each LED falls back to its next highest layer, or once none
+ *        is left to the steady duty cycle it had before the layers took it
+ *
+ * @param [in] layer The layer of the caller
+ * @param [in] led_mask bitmask of the LEDs to release
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_layer_release(led_layer layer, uint32_t led_mask) {
+  LED_TRACE("led_layer_release", led_mask, layer);
+  bool kick = false;
+
+  if (IS_INVALID_LAYER(layer) || (led_mask & ~LED_ALL_MASK)) {
+    return -EINVAL;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  while (led_mask) {
+    uint32_t led = __builtin_ctz(led_mask);
+    led_mask &= led_mask - 1;
+    if (_leds[led].layers.mask & BIT(layer)) {
+      _leds[led].layers.mask &= ~BIT(layer);
+      kick |= _led_layers_resolve(led, LED_LAYER_NONE);
+    }
+  }
+  k_spin_unlock(&_led_lock, key);
+
+  _led_flush();
+  if (kick) {
+    _led_blink_kick();
+  }
+  return 0;
+}
+#endif
+
+#if defined(CONFIG_LED_ASYNC)
+/**
+ * @brief Queues a toggle of the LED for the engine, as LED_toggle. Never blocks and takes no lock,
+ *        safe from interrupts and GPIO callbacks
+ *
+ * @param [in] led The LED instance to toggle
+ *
+ * @return Error code, -EAGAIN if the queue is full
+ */
+int LED_toggle_async(led_id led) {
+  if (IS_INVALID_LED(led)) {
+    return -EINVAL;
+  }
+  return _led_async_push(LED_COMMAND_TOGGLE, led, 0);
+}
+
+/**
+ * @brief Queues LED_set for the engine, safe from interrupts
+ *
+ * @param [in] led The LED instance to set
+ * @param [in] new_state The state to set the led to
+ *
+ * @return Error code, -EAGAIN if the queue is full
+ */
+int LED_set_async(led_id led, led_state new_state) {
+  if (IS_INVALID_LED(led)) {
+    return -EINVAL;
+  }
+  return _led_async_push(LED_COMMAND_SET, led, new_state);
+}
+
+/**
+ * @brief Queues LED_pwm for the engine, safe from interrupts
+ *
+ * @param [in] led The LED instance to set the pwm duty cycle of
+ * @param [in] duty_cycle The duty cycle to set the LED to, expects 0 - 100 only
+ *
+ * @return Error code, -EAGAIN if the queue is full
+ */
+int LED_pwm_async(led_id led, uint8_t duty_cycle) {
+  if (IS_INVALID_LED(led)) {
+    return -EINVAL;
+  }
+  return _led_async_push(LED_COMMAND_PWM, led, duty_cycle);
+}
 
-  if (!_led_blink_thread.led_bitmask) {
-    k_thread_resume(_led_blink_thread.id);
+/**
+ * @brief Queues LED_set_mask for the engine, safe from interrupts
+ *
+ * @param [in] led_mask Bitmask of the LED instances to set, BIT(LEDx)
+ * @param [in] on_mask Bitmask of the LEDs in led_mask to turn on, the others are turned off
+ *
+ * @return Error code, -EAGAIN if the queue is full
+ */
+int LED_set_mask_async(uint32_t led_mask, uint32_t on_mask) {
+  if (led_mask & ~LED_ALL_MASK) {
+    return -EINVAL;
+  }
+  return _led_async_push(LED_COMMAND_SET_MASK, led_mask, on_mask);
+}
+
+/**
+ * @brief Queues LED_blink for the engine, safe from interrupts
+ *
+ * @param [in] led The LED instance to blink
+ * @param [in] frequency The frequency to blink the LED at
+ *
+ * @return Error code, -EAGAIN if the queue is full
+ */
+int LED_blink_async(led_id led, led_frequency frequency) {
+  if (IS_INVALID_LED(led) || frequency > LED_16HZ || frequency <= 0) {
+    return -EINVAL;
+  }
+  return _led_async_push(LED_COMMAND_BLINK, led, frequency);
+}
+#endif
+
+#if defined(CONFIG_LED_PATTERN)
+/**
+ * @brief Plays a keyframe pattern from the engine, replacing the pattern already playing.
+ *        Every LED any frame sets follows the pattern until it ends or the LED is set, blinked
+ *        or faded. Each frame is one batched update, the pattern must stay valid while playing
+ *
+ * @param [in] pattern The pattern to play, usually from LED_PATTERN_DEFINE
+ *
+ * @return Error code, < 0 on failures
+ */
+int LED_pattern_play(const led_pattern *pattern) {
+  uint32_t led_mask = 0;
+  bool holds = false;
+
+  if (NULL == pattern || NULL == pattern->frames || 0 == pattern->num_frames) {
+    return -EINVAL;
+  }
+  for (int i = 0; i < pattern->num_frames; i++) {
+    led_mask |= pattern->frames[i].mask;
+    holds |= 0 != pattern->frames[i].hold_ms;
+  }
+  if ((led_mask & ~LED_ALL_MASK) || 0 == led_mask || !holds) {
+    return -EINVAL;
   }
+  LED_TRACE("led_pattern_play", led_mask, pattern->num_frames);
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+
+  // LEDs of the previous pattern this one doesn't set stay at their last frame
+  atomic_clear(&_led_blink_engine.pattern_bitmask);
+  _led_halt_effects(led_mask);
+
+  _led_blink_engine.pattern = pattern;
+  _led_blink_engine.frame = 0;
+  _led_blink_engine.plays_left = pattern->repeat ? pattern->repeat - 1 : 0;
+  _led_blink_engine.pattern_deadline = k_uptime_ticks();
+  atomic_set(&_led_blink_engine.pattern_bitmask, led_mask);
+
+  k_spin_unlock(&_led_lock, key);
+
+  _led_flush();
+  // The engine shows the first frame right away
+  _led_blink_kick();
+  return 0;
+}
+
+/**
+ * @brief Stops the playing pattern, its LEDs hold the frame they were on
+ */
+void LED_pattern_stop() {
+  LED_TRACE("led_pattern_stop", 0, 0);
+
+  k_spinlock_key_t key = k_spin_lock(&_led_lock);
+  atomic_clear(&_led_blink_engine.pattern_bitmask);
+  // Writes nothing, only lets the PWM suspend if the pattern stopped on dark LEDs
+  _led_commit(0);
+  k_spin_unlock(&_led_lock, key);
 
-  _led_blink_thread.led_bitmask |= BIT(led);
+  _led_flush();
+  _led_blink_kick();
 }
+#endif
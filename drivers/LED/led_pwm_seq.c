@@ -0,0 +1,351 @@
+/*
+nRF PWM sequence playback backend for the led module. Takes over the PWM instance of the
+pwm_nrfx driver, programs its clock for the LEDs' period itself and points its sequence
+registers at a RAM buffer which EasyDMA loops forever, so blinking costs no CPU time at all. Static outputs are
+looped the same way from a one step sequence, which lets every channel change together.
+*/
+
+#include <zephyr/kernel.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/pwm.h>
+#include <hal/nrf_pwm.h>
+
+#include "led_pwm_seq.h"
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define LED_PWM_SEQ_POLARITY      BIT(15) // Same channel value encoding as pwm_nrfx
+#define LED_PWM_SEQ_COMPARE_MASK  BIT_MASK(15)
+#define LED_PWM_SEQ_TOP_MAX       BIT_MASK(15) // COUNTERTOP is 15 bits wide
+#define LED_PWM_SEQ_BASE_HZ       16000000ULL // PWM clock before the prescaler
+#define LED_PWM_SEQ_PRESCALER_MAX 7 // Divides the base clock by up to 2^7
+
+/* ----------------------------------------------------------------------------
+                                  Macro Helpers
+---------------------------------------------------------------------------- */
+#define LED_PWM_SEQ_INSTANCE(node_id) {.reg=(NRF_PWM_Type *)DT_REG_ADDR(node_id), .dev=DEVICE_DT_GET(node_id)},
+
+/* ----------------------------------------------------------------------------
+                                    Types
+---------------------------------------------------------------------------- */
+typedef struct led_pwm_seq_instance_t {
+  NRF_PWM_Type *reg;
+  const struct device *dev;
+} led_pwm_seq_instance;
+
+typedef struct led_pwm_seq_t {
+  NRF_PWM_Type *reg;
+  const struct device *dev;
+  led_pwm_seq_channel waves[LED_PWM_SEQ_CHANNELS]; // Waveform currently loaded on each channel
+  uint32_t period_ns; // Shared by all channels of the instance
+  uint16_t top; // COUNTERTOP for period_ns, programmed by every load
+  uint8_t prescaler;
+  uint16_t steps; // PWM periods in the loaded sequence
+  uint8_t channel_mask;
+  uint8_t inverted_mask;
+  bool playing;
+} led_pwm_seq_type;
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static uint16_t _led_pwm_seq_value(uint32_t channel, uint32_t pulse_ns);
+
+static uint64_t _led_pwm_seq_lcm(uint64_t a, uint64_t b);
+
+static int _led_pwm_seq_steps(const led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]);
+
+static int _led_pwm_seq_load(void);
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+static uint16_t _led_pwm_seq_buf[CONFIG_LED_PWM_SEQUENCE_MAX_STEPS][LED_PWM_SEQ_CHANNELS];
+
+// Every enabled nRF PWM, the first channel added picks the instance the sequence plays on
+static const led_pwm_seq_instance _led_pwm_seq_instances[] = {
+  DT_FOREACH_STATUS_OKAY(nordic_nrf_pwm, LED_PWM_SEQ_INSTANCE)
+};
+
+static led_pwm_seq_type _led_pwm_seq = {
+  .reg = NULL,
+  .dev = NULL,
+  .period_ns = 0,
+  .channel_mask = 0,
+  .playing = false,
+};
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Converts a pulse width into the 16 bit sequence value EasyDMA loads for a channel
+ *
+ * @param [in] channel the PWM channel the value is for
+ * @param [in] pulse_ns the pulse width to convert
+ *
+ * @return Compare value and polarity bit for the channel
+ */
+static uint16_t _led_pwm_seq_value(uint32_t channel, uint32_t pulse_ns) {
+  uint32_t top = _led_pwm_seq.top;
+  uint32_t compare = (uint32_t)(((uint64_t)pulse_ns * top) / _led_pwm_seq.period_ns);
+  compare = MIN(compare, top) & LED_PWM_SEQ_COMPARE_MASK;
+  bool inverted = _led_pwm_seq.inverted_mask & BIT(channel);
+  return compare | (inverted ? 0 : LED_PWM_SEQ_POLARITY);
+}
+
+/**
+ * @brief Least common multiple of two non zero values
+ */
+static uint64_t _led_pwm_seq_lcm(uint64_t a, uint64_t b) {
+  uint64_t x = a;
+  uint64_t y = b;
+  while (y) {
+    uint64_t r = x % y;
+    x = y;
+    y = r;
+  }
+  return (a / x) * b;
+}
+
+/**
+ * @brief Counts the PWM periods a sequence of the given waveforms takes to repeat
+ *
+ * @param [in] channels the waveform of every channel of the instance
+ *
+ * @return Number of steps, -ENOTSUP if a part or phase isn't a whole number of PWM periods,
+ *         -ENOSPC if the waveforms don't repeat within the sequence buffer
+ */
+static int _led_pwm_seq_steps(const led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]) {
+  if (!_led_pwm_seq.channel_mask) {
+    return -ENODEV;
+  }
+
+  uint64_t step_ns = _led_pwm_seq.period_ns;
+  uint64_t window_ns = step_ns;
+  for (int ch = 0; ch < LED_PWM_SEQ_CHANNELS; ch++) {
+    uint64_t cycle_ns = ((uint64_t)channels[ch].duration_us[0] + channels[ch].duration_us[1]) * NSEC_PER_USEC;
+    if (cycle_ns) {
+      // Each step holds one value for a whole period, anything finer would be sampled into uneven runs
+      if (((uint64_t)channels[ch].duration_us[0] * NSEC_PER_USEC) % step_ns ||
+          ((uint64_t)channels[ch].duration_us[1] * NSEC_PER_USEC) % step_ns ||
+          ((uint64_t)channels[ch].phase_us * NSEC_PER_USEC) % step_ns) {
+        return -ENOTSUP;
+      }
+      window_ns = _led_pwm_seq_lcm(window_ns, cycle_ns);
+      if (window_ns / step_ns > CONFIG_LED_PWM_SEQUENCE_MAX_STEPS) {
+        return -ENOSPC;
+      }
+    }
+  }
+  return window_ns / step_ns;
+}
+
+/**
+ * @brief Fills the sequence buffer from the channel waveforms and loops it from the start
+ *
+ * @return Error code, -ENOTSUP if a part or phase isn't a whole number of PWM periods,
+ *         -ENOSPC if the waveforms don't repeat within the sequence buffer
+ */
+static int _led_pwm_seq_load(void) {
+  const led_pwm_seq_channel *channels = _led_pwm_seq.waves;
+  uint64_t step_ns = _led_pwm_seq.period_ns;
+  int rv = _led_pwm_seq_steps(channels);
+  if (rv < 0) {
+    return rv;
+  }
+
+  uint16_t steps = rv;
+  for (int ch = 0; ch < LED_PWM_SEQ_CHANNELS; ch++) {
+    const led_pwm_seq_channel *wave = &channels[ch];
+    uint16_t values[2] = {_led_pwm_seq_value(ch, wave->pulse_ns[0]), _led_pwm_seq_value(ch, wave->pulse_ns[1])};
+    uint64_t first_ns = (uint64_t)wave->duration_us[0] * NSEC_PER_USEC;
+    uint64_t cycle_ns = first_ns + (uint64_t)wave->duration_us[1] * NSEC_PER_USEC;
+
+    if (!cycle_ns) {
+      for (uint16_t i = 0; i < steps; i++) {
+        _led_pwm_seq_buf[i][ch] = values[0];
+      }
+      continue;
+    }
+
+    // Sample the waveform at the start of every PWM period
+    uint64_t t = ((uint64_t)wave->phase_us * NSEC_PER_USEC) % cycle_ns;
+    for (uint16_t i = 0; i < steps; i++) {
+      _led_pwm_seq_buf[i][ch] = values[(t < first_ns) ? 0 : 1];
+      t += step_ns;
+      if (t >= cycle_ns) {
+        t -= cycle_ns;
+      }
+    }
+  }
+
+  NRF_PWM_Type *reg = _led_pwm_seq.reg;
+  _led_pwm_seq.steps = steps;
+
+  // pwm_nrfx only sets the clock up on its own writes, which may never have happened
+  nrf_pwm_configure(reg, (nrf_pwm_clk_t)_led_pwm_seq.prescaler, NRF_PWM_MODE_UP, _led_pwm_seq.top);
+  nrf_pwm_decoder_set(reg, NRF_PWM_LOAD_INDIVIDUAL, NRF_PWM_STEP_AUTO);
+  for (uint8_t seq = 0; seq < 2; seq++) {
+    // Both sequences play the same buffer, LOOPSDONE restarts the first one forever
+    nrf_pwm_seq_ptr_set(reg, seq, &_led_pwm_seq_buf[0][0]);
+    nrf_pwm_seq_cnt_set(reg, seq, steps * LED_PWM_SEQ_CHANNELS);
+    nrf_pwm_seq_refresh_set(reg, seq, 0);
+    nrf_pwm_seq_end_delay_set(reg, seq, 0);
+  }
+  nrf_pwm_loop_set(reg, 1);
+  nrf_pwm_shorts_set(reg, NRF_PWM_SHORT_LOOPSDONE_SEQSTART0_MASK);
+  nrf_pwm_enable(reg);
+  nrf_pwm_task_trigger(reg, NRF_PWM_TASK_SEQSTART0);
+
+  _led_pwm_seq.playing = true;
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Registers a PWM channel with the sequence backend
+ *
+ * @param [in] spec the PWM spec of the channel
+ *
+ * @return Error code, -ENOTSUP if the channel can't be played from the shared sequence
+ */
+int led_pwm_seq_add_channel(const struct pwm_dt_spec *spec) {
+  if (NULL == _led_pwm_seq.dev) {
+    for (size_t i = 0; i < ARRAY_SIZE(_led_pwm_seq_instances); i++) {
+      if (spec->dev == _led_pwm_seq_instances[i].dev) {
+        _led_pwm_seq.reg = _led_pwm_seq_instances[i].reg;
+        _led_pwm_seq.dev = _led_pwm_seq_instances[i].dev;
+      }
+    }
+  }
+
+  if (spec->dev != _led_pwm_seq.dev) {
+    return -ENOTSUP;
+  } else if (spec->channel >= LED_PWM_SEQ_CHANNELS) {
+    return -EINVAL;
+  } else if (_led_pwm_seq.period_ns && _led_pwm_seq.period_ns != spec->period) {
+    // All channels of an instance share COUNTERTOP
+    return -ENOTSUP;
+  } else if (spec->period < NSEC_PER_USEC) {
+    return -EINVAL;
+  }
+
+  if (0 == _led_pwm_seq.period_ns) {
+    // Fastest clock whose COUNTERTOP still spans the period, for the finest duty cycle steps
+    uint64_t cycles = (LED_PWM_SEQ_BASE_HZ * spec->period) / NSEC_PER_SEC;
+    uint8_t prescaler = 0;
+    while ((cycles >> prescaler) > LED_PWM_SEQ_TOP_MAX) {
+      if (++prescaler > LED_PWM_SEQ_PRESCALER_MAX) {
+        return -ENOTSUP;
+      }
+    }
+    _led_pwm_seq.prescaler = prescaler;
+    _led_pwm_seq.top = cycles >> prescaler;
+  }
+
+  _led_pwm_seq.period_ns = spec->period;
+  _led_pwm_seq.channel_mask |= BIT(spec->channel);
+  if (spec->flags & PWM_POLARITY_INVERTED) {
+    _led_pwm_seq.inverted_mask |= BIT(spec->channel);
+  }
+  return 0;
+}
+
+/**
+ * @brief Checks if the given waveforms can be played, touches neither the buffer nor the peripheral
+ *
+ * @param [in] channels the waveform of every channel of the instance
+ *
+ * @return Error code, -ENOTSUP if a part or phase isn't a whole number of PWM periods,
+ *         -ENOSPC if the waveforms don't repeat within the sequence buffer
+ */
+int led_pwm_seq_check(const led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]) {
+  int rv = _led_pwm_seq_steps(channels);
+  return (rv < 0) ? rv : 0;
+}
+
+/**
+ * @brief Loads new waveforms for every channel of the instance and loops them from the start
+ *
+ * @param [in] channels the waveform of every channel of the instance
+ *
+ * @return Error code, -ENOTSUP if a part or phase isn't a whole number of PWM periods,
+ *         -ENOSPC if the waveforms don't repeat within the sequence buffer
+ */
+int led_pwm_seq_play(const led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]) {
+  led_pwm_seq_channel previous[LED_PWM_SEQ_CHANNELS];
+  memcpy(previous, _led_pwm_seq.waves, sizeof(previous));
+  memcpy(_led_pwm_seq.waves, channels, sizeof(_led_pwm_seq.waves));
+
+  int rv = _led_pwm_seq_load();
+  if (rv < 0) {
+    // Keep describing what is actually playing
+    memcpy(_led_pwm_seq.waves, previous, sizeof(previous));
+  }
+  return rv;
+}
+
+/**
+ * @brief Sets channels to constant pulses, all of them change on the same PWM period
+ *
+ * @param [in] channel_mask the PWM channels to set
+ * @param [in] pulse_ns the pulse width to hold on each channel, indexed by channel
+ *
+ * @return Error code, < 0 on failures
+ */
+int led_pwm_seq_write(uint8_t channel_mask, const uint32_t pulse_ns[LED_PWM_SEQ_CHANNELS]) {
+  uint16_t values[LED_PWM_SEQ_CHANNELS];
+  channel_mask &= _led_pwm_seq.channel_mask;
+
+  for (uint8_t ch = 0; ch < LED_PWM_SEQ_CHANNELS; ch++) {
+    if (channel_mask & BIT(ch)) {
+      led_pwm_seq_channel *wave = &_led_pwm_seq.waves[ch];
+      wave->pulse_ns[0] = pulse_ns[ch];
+      wave->pulse_ns[1] = pulse_ns[ch];
+      wave->duration_us[0] = 0;
+      wave->duration_us[1] = 0;
+      values[ch] = _led_pwm_seq_value(ch, pulse_ns[ch]);
+    }
+  }
+
+  if (!_led_pwm_seq.playing) {
+    return _led_pwm_seq_load();
+  }
+
+  // EasyDMA reads one step per period, writing step by step keeps the channels of a step together
+  for (uint16_t i = 0; i < _led_pwm_seq.steps; i++) {
+    for (uint8_t ch = 0; ch < LED_PWM_SEQ_CHANNELS; ch++) {
+      if (channel_mask & BIT(ch)) {
+        _led_pwm_seq_buf[i][ch] = values[ch];
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Stops looping the sequence, the pwm driver takes over on its next playback
+ */
+void led_pwm_seq_stop(void) {
+  if (!_led_pwm_seq.playing) {
+    return;
+  }
+
+  nrf_pwm_shorts_set(_led_pwm_seq.reg, 0);
+  nrf_pwm_loop_set(_led_pwm_seq.reg, 0);
+  _led_pwm_seq.playing = false;
+}
+
+/**
+ * @brief Checks if the sequence currently owns the PWM outputs
+ *
+ * @return true if a sequence is looping
+ */
+bool led_pwm_seq_is_playing(void) {
+  return _led_pwm_seq.playing;
+}
@@ -0,0 +1,46 @@
+/*
+Header to define the nRF PWM sequence playback backend used by the led module
+*/
+
+#ifndef LED_PWM_SEQ_H
+#define LED_PWM_SEQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/drivers/pwm.h>
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define LED_PWM_SEQ_CHANNELS      4 // Channels per nRF PWM instance
+
+/* ----------------------------------------------------------------------------
+                                    TYPES
+---------------------------------------------------------------------------- */
+/**
+ * A channel waveform made of two parts that repeat, e.g. the on and off halves of a blink.
+ * A static channel sets both pulses to the same value.
+ */
+typedef struct led_pwm_seq_channel_t {
+  uint32_t pulse_ns[2]; // Pulse played during each part
+  uint32_t duration_us[2]; // Length of each part, both 0 for a static channel
+  uint32_t phase_us; // Position in the cycle at which playback starts
+} led_pwm_seq_channel;
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+int led_pwm_seq_add_channel(const struct pwm_dt_spec *spec);
+
+int led_pwm_seq_check(const led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]);
+
+int led_pwm_seq_play(const led_pwm_seq_channel channels[LED_PWM_SEQ_CHANNELS]);
+
+int led_pwm_seq_write(uint8_t channel_mask, const uint32_t pulse_ns[LED_PWM_SEQ_CHANNELS]);
+
+void led_pwm_seq_stop(void);
+
+bool led_pwm_seq_is_playing(void);
+
+#endif
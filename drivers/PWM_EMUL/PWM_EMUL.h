@@ -0,0 +1,37 @@
+/*
+Header to define the emulated PWM controller interface
+*/
+
+#ifndef PWM_EMUL_H
+#define PWM_EMUL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/pwm.h>
+
+/* ----------------------------------------------------------------------------
+                                    TYPES
+---------------------------------------------------------------------------- */
+typedef struct pwm_emul_channel_t {
+  uint32_t period_cycles; // Last period set, 0 until the channel is first set
+  uint32_t pulse_cycles; // Last pulse set
+  pwm_flags_t flags;
+  uint32_t writes; // pwm_set calls on the channel
+  uint32_t changes; // Writes that changed the period, pulse or flags
+  int64_t changed_ticks; // k_uptime_ticks() of the last change
+} pwm_emul_channel;
+
+// Told about every write to a channel, after the channel state is updated
+typedef void (*pwm_emul_callback)(const struct device *dev, uint32_t channel, const pwm_emul_channel *state);
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+int PWM_EMUL_get_channel(const struct device *dev, uint32_t channel, pwm_emul_channel *state);
+
+void PWM_EMUL_set_callback(const struct device *dev, pwm_emul_callback callback);
+
+bool PWM_EMUL_is_suspended(const struct device *dev);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+Emulated PWM controller for host builds. Keeps the period and pulse every channel was last
+set to and reports every write to an optional callback, so the LED driver can be checked and
+timed on native_sim without hardware.
+*/
+
+#define DT_DRV_COMPAT zephyr_pwm_emul
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/pwm.h>
+#include <zephyr/pm/device.h>
+
+#include "PWM_EMUL.h"
+
+/* ----------------------------------------------------------------------------
+                                    Constants
+---------------------------------------------------------------------------- */
+#define PWM_EMUL_MAX_CHANNELS     16
+
+/* ----------------------------------------------------------------------------
+                                    Types
+---------------------------------------------------------------------------- */
+typedef struct pwm_emul_config_t {
+  uint64_t cycles_per_sec;
+  uint32_t num_channels;
+} pwm_emul_config;
+
+typedef struct pwm_emul_data_t {
+  struct k_spinlock lock;
+  pwm_emul_channel channels[PWM_EMUL_MAX_CHANNELS];
+  pwm_emul_callback callback;
+  bool suspended;
+} pwm_emul_data;
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static int _pwm_emul_set_cycles(const struct device *dev, uint32_t channel, uint32_t period_cycles,
+  uint32_t pulse_cycles, pwm_flags_t flags);
+
+static int _pwm_emul_get_cycles_per_sec(const struct device *dev, uint32_t channel, uint64_t *cycles);
+
+static int _pwm_emul_pm_action(const struct device *dev, enum pm_device_action action);
+
+static int _pwm_emul_init(const struct device *dev);
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+static DEVICE_API(pwm, _pwm_emul_api) = {
+  .set_cycles = _pwm_emul_set_cycles,
+  .get_cycles_per_sec = _pwm_emul_get_cycles_per_sec,
+};
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+static int _pwm_emul_set_cycles(const struct device *dev, uint32_t channel, uint32_t period_cycles,
+  uint32_t pulse_cycles, pwm_flags_t flags) {
+  const pwm_emul_config *config = dev->config;
+  pwm_emul_data *data = dev->data;
+
+  if (channel >= config->num_channels || pulse_cycles > period_cycles) {
+    return -EINVAL;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&data->lock);
+  pwm_emul_channel *state = &data->channels[channel];
+  state->writes++;
+  if (state->period_cycles != period_cycles || state->pulse_cycles != pulse_cycles || state->flags != flags) {
+    state->period_cycles = period_cycles;
+    state->pulse_cycles = pulse_cycles;
+    state->flags = flags;
+    state->changes++;
+    state->changed_ticks = k_uptime_ticks();
+  }
+  pwm_emul_channel snapshot = *state;
+  pwm_emul_callback callback = data->callback;
+  k_spin_unlock(&data->lock, key);
+
+  if (NULL != callback) {
+    callback(dev, channel, &snapshot);
+  }
+  return 0;
+}
+
+static int _pwm_emul_get_cycles_per_sec(const struct device *dev, uint32_t channel, uint64_t *cycles) {
+  const pwm_emul_config *config = dev->config;
+
+  if (channel >= config->num_channels) {
+    return -EINVAL;
+  }
+  *cycles = config->cycles_per_sec;
+  return 0;
+}
+
+/**
+ * @brief Only tracks the state so callers can check the LED driver suspends the controller,
+ *        channels keep their last setting like the real peripheral's registers do
+ */
+static int _pwm_emul_pm_action(const struct device *dev, enum pm_device_action action) {
+  pwm_emul_data *data = dev->data;
+
+  switch (action) {
+    case PM_DEVICE_ACTION_SUSPEND:
+      data->suspended = true;
+      return 0;
+    case PM_DEVICE_ACTION_RESUME:
+      data->suspended = false;
+      return 0;
+    default:
+      return -ENOTSUP;
+  }
+}
+
+static int _pwm_emul_init(const struct device *dev) {
+  return pm_device_driver_init(dev, _pwm_emul_pm_action);
+}
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Reads back the state of a channel
+ *
+ * @param [in] dev An emulated PWM controller
+ * @param [in] channel The channel to read
+ * @param [out] state Filled with the channel's state
+ *
+ * @return Error code, < 0 on failures
+ */
+int PWM_EMUL_get_channel(const struct device *dev, uint32_t channel, pwm_emul_channel *state) {
+  const pwm_emul_config *config = dev->config;
+  pwm_emul_data *data = dev->data;
+
+  if (channel >= config->num_channels || NULL == state) {
+    return -EINVAL;
+  }
+
+  k_spinlock_key_t key = k_spin_lock(&data->lock);
+  *state = data->channels[channel];
+  k_spin_unlock(&data->lock, key);
+  return 0;
+}
+
+/**
+ * @brief Sets the function told about every write, it runs in the context of the pwm_set call
+ *
+ * @param [in] dev An emulated PWM controller
+ * @param [in] callback The function to call, NULL to stop
+ */
+void PWM_EMUL_set_callback(const struct device *dev, pwm_emul_callback callback) {
+  pwm_emul_data *data = dev->data;
+
+  k_spinlock_key_t key = k_spin_lock(&data->lock);
+  data->callback = callback;
+  k_spin_unlock(&data->lock, key);
+}
+
+/**
+ * @brief Tells whether device power management has the controller suspended
+ */
+bool PWM_EMUL_is_suspended(const struct device *dev) {
+  pwm_emul_data *data = dev->data;
+  return data->suspended;
+}
+
+// Interrupt safe runtime PM like the nRF PWM, the LED driver resumes it under its spinlock
+#define PWM_EMUL_INIT(n) \
+  BUILD_ASSERT(DT_INST_PROP(n, channels) <= PWM_EMUL_MAX_CHANNELS, "Too many emulated PWM channels"); \
+  static const pwm_emul_config _pwm_emul_config_##n = { \
+    .cycles_per_sec = DT_INST_PROP(n, clock_frequency), \
+    .num_channels = DT_INST_PROP(n, channels), \
+  }; \
+  static pwm_emul_data _pwm_emul_data_##n; \
+  PM_DEVICE_DT_INST_DEFINE(n, _pwm_emul_pm_action, PM_DEVICE_ISR_SAFE); \
+  DEVICE_DT_INST_DEFINE(n, _pwm_emul_init, PM_DEVICE_DT_INST_GET(n), &_pwm_emul_data_##n, \
+    &_pwm_emul_config_##n, POST_KERNEL, CONFIG_PWM_INIT_PRIORITY, &_pwm_emul_api);
+
+DT_INST_FOREACH_STATUS_OKAY(PWM_EMUL_INIT)
@@ -0,0 +1,38 @@
+/*
+Header to define the event driven state machine interface
+*/
+
+#ifndef SM_H
+#define SM_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include <zephyr/smf.h>
+
+/* ----------------------------------------------------------------------------
+                                    TYPES
+---------------------------------------------------------------------------- */
+typedef enum sm_event_type_t {
+  SM_EVENT_BTN = 0, // source is the btn_id, arg the btn_event_type, clicks the click count
+  SM_EVENT_LED_DONE, // source is the led_id whose fade ended
+  SM_EVENT_USER, // Posted by the application, source and arg are its own
+} sm_event_type;
+
+typedef struct sm_event_t {
+  uint32_t cycles; // k_cycle_get_32() when the event happened
+  uint8_t type; // sm_event_type
+  uint8_t source;
+  uint8_t arg;
+  uint8_t clicks;
+} sm_event;
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+int SM_init();
+
+int SM_post(const sm_event *event);
+
+int32_t SM_run(struct smf_ctx *ctx, sm_event *event);
+
+#endif
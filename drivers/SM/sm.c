@@ -0,0 +1,102 @@
+/*
+Header to define event driven state machine logic
+*/
+
+#include <zephyr/kernel.h>
+#include <zephyr/smf.h>
+
+#include "SM.h"
+#include "BTN.h"
+#include "LED.h"
+#include "LATENCY.h"
+
+/* ----------------------------------------------------------------------------
+                            Private Function Prototypes
+---------------------------------------------------------------------------- */
+static void _sm_btn_event(const btn_event *event);
+
+#if defined(CONFIG_LED_BLINK)
+static void _sm_led_done(led_id led);
+#endif
+
+/* ----------------------------------------------------------------------------
+                                Global States
+---------------------------------------------------------------------------- */
+K_MSGQ_DEFINE(_sm_event_queue, sizeof(sm_event), CONFIG_SM_EVENT_QUEUE_SIZE, 4);
+
+/* ----------------------------------------------------------------------------
+                              Private Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Forwards a button event into the state machine queue
+ *
+ * @param [in] event The button event
+ */
+static void _sm_btn_event(const btn_event *event) {
+  sm_event sm = {.cycles=event->cycles, .type=SM_EVENT_BTN, .source=event->btn, .arg=event->type, .clicks=event->clicks};
+  SM_post(&sm);
+}
+
+#if defined(CONFIG_LED_BLINK)
+/**
+ * @brief Forwards the end of an LED fade into the state machine queue
+ *
+ * @param [in] led The LED whose fade ended
+ */
+static void _sm_led_done(led_id led) {
+  sm_event sm = {.cycles=k_cycle_get_32(), .type=SM_EVENT_LED_DONE, .source=led};
+  SM_post(&sm);
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+                              Public Functions
+---------------------------------------------------------------------------- */
+/**
+ * @brief Hooks the state machine queue up to the button and LED drivers
+ *
+ * @return Error code, < 0 on failures
+ */
+int SM_init() {
+  k_msgq_purge(&_sm_event_queue);
+  BTN_set_event_callback(_sm_btn_event);
+  // Every event reaches the state machine through the callback, nothing reads the button queue
+  BTN_set_event_queueing(false);
+#if defined(CONFIG_LED_BLINK)
+  LED_set_done_callback(_sm_led_done);
+#endif
+  return 0;
+}
+
+/**
+ * @brief Queues an event for the state machine, safe to call from interrupts
+ *
+ * @param [in] event The event to queue, copied
+ *
+ * @return Error code, -ENOMSG if the queue is full and the event was dropped
+ */
+int SM_post(const sm_event *event) {
+  if (NULL == event) {
+    return -EINVAL;
+  }
+  return k_msgq_put(&_sm_event_queue, event, K_NO_WAIT);
+}
+
+/**
+ * @brief Sleeps until the next event then runs the current state with it
+ *
+ * @param [in] ctx The state machine context, the first member of the state machine object
+ * @param [out] event The state machine object's event slot, filled before the state runs
+ *
+ * @return The smf_run_state result, non zero once the state machine has terminated
+ */
+int32_t SM_run(struct smf_ctx *ctx, sm_event *event) {
+  int rv = k_msgq_get(&_sm_event_queue, event, K_FOREVER);
+  if (rv < 0) {
+    return rv;
+  }
+  if (SM_EVENT_BTN == event->type) {
+    LATENCY_PROBE(LATENCY_BTN_DEQUEUED, event->source);
+  }
+  return smf_run_state(ctx);
+}